@@ -0,0 +1,327 @@
+/*
+    Load generator for aesdsocket. Each of -c client threads keeps one
+    connection in flight at a time: connect, send one line, half-close
+    and read the response to EOF (the server delimits responses only by
+    closing). A line is a data line of -s bytes or, for -S percent of
+    requests, an AESDCHAR_IOCSEEKTO:X,Y command aimed at a line already
+    written. Runs -n requests per client, or for -d seconds.
+
+    Without -r every client issues requests back to back (closed loop).
+    -r paces the clients to a total rate in requests/s (open loop); a
+    request's latency is then measured from when it was scheduled, so
+    a stalled server is charged for the requests queued behind it.
+
+    Reports throughput and p50/p99/p999 latency for each request kind,
+    then with -x the server's own AESDSOCKET_STATS report (e.g. how many
+    appends each group commit fdatasync covered). -v checks every data
+    response: it must hold only whole client lines and "timestamp:"
+    lines, so a server sending appends it has not published yet (torn
+    lines, zero-filled holes) fails the run.
+
+    usage: aesdload [-h host] [-p port] [-c clients] [-n requests | -d seconds]
+                    [-s linesize] [-r rate] [-S seekpct] [-x] [-v]
+*/
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef enum { REQ_DATA, REQ_SEEKTO, NREQKINDS } RequestKind;
+
+typedef struct {
+    double *v;           // Per-request latency (us)
+    long n, cap;
+} Latencies;
+
+typedef struct {
+    int id;
+    unsigned int seed;
+    Latencies lat[NREQKINDS];
+    long nfail;
+    long nbad;           // Data responses failing -v
+    size_t nrecv;        // Response bytes received
+} LoadClient;
+
+// Line being checked by -v, fed in receive-sized pieces
+typedef struct {
+    size_t len;
+    char first;
+    int uniform;
+    char head[10];
+    int bad;
+} LineCheck;
+
+static const char *kindNames[NREQKINDS] = { "data", "seekto" };
+
+static const char *host = "127.0.0.1";
+static const char *port = "9000";
+static long nclients = 4;
+static long nrequests = 1000;
+static double duration = 0;    // Seconds, overrides nrequests when set
+static size_t linesz = 32;
+static double rate = 0;        // Total requests/s, 0 for closed loop
+static int seekpct = 0;
+static int serverstats = 0;
+static int verify = 0;
+static struct addrinfo *server;
+
+// Data lines acknowledged so far, SEEKTO targets are drawn below it
+static atomic_long linesWritten;
+
+
+static double nowus() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void sleepUntil(double us) {
+    struct timespec ts = { .tv_sec = (time_t)(us / 1e6) };
+    ts.tv_nsec = (long)((us - ts.tv_sec * 1e6) * 1e3);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) ;
+}
+
+static int addLatency(Latencies *self, double us) {
+    if (self->n == self->cap) {
+        long cap = self->cap ? self->cap * 2 : 1024;
+        double *v = (double *)realloc(self->v, cap * sizeof(double));
+        if (v == NULL) return -1;
+        self->v = v;
+        self->cap = cap;
+    }
+    self->v[self->n++] = us;
+    return 0;
+}
+
+// Checks n more response bytes: each line must be linesz - 1 copies of
+// one client letter or a timestamp, and no byte may be NUL
+static void checkLines(LineCheck *lc, const char *p, size_t n) {
+    static const char tstamp[] = "timestamp:";
+
+    for (size_t i = 0; i < n && !lc->bad; i++) {
+        char ch = p[i];
+        if (ch == '\0') lc->bad = 1;
+        else if (ch == '\n') {
+            int client = lc->len == linesz - 1 && lc->uniform && lc->first >= 'a' && lc->first <= 'z';
+            int timestamp = lc->len >= sizeof(lc->head) && memcmp(lc->head, tstamp, sizeof(lc->head)) == 0;
+            if (!client && !timestamp) lc->bad = 1;
+            lc->len = 0;
+            lc->uniform = 1;
+        }
+        else {
+            if (lc->len < sizeof(lc->head)) lc->head[lc->len] = ch;
+            if (lc->len == 0) lc->first = ch;
+            else if (ch != lc->first) lc->uniform = 0;
+            lc->len += 1;
+        }
+    }
+}
+
+// Returns response bytes received, or -1 on ERROR. Checks the lines
+// received when lc is set.
+static ssize_t request(const char *line, size_t n, char *rbuf, size_t rbufsz, LineCheck *lc) {
+    int cfd = socket(server->ai_family, server->ai_socktype, server->ai_protocol);
+    if (cfd == -1) return -1;
+    else if (connect(cfd, server->ai_addr, server->ai_addrlen) == -1) {
+        close(cfd);
+        return -1;
+    }
+
+    ssize_t nw;
+    for (size_t off = 0; off < n; off += nw) {
+        if ((nw = send(cfd, line + off, n - off, MSG_NOSIGNAL)) <= 0) {
+            close(cfd);
+            return -1;
+        }
+    }
+    shutdown(cfd, SHUT_WR);
+
+    ssize_t nr, total = 0;
+    while ((nr = recv(cfd, rbuf, rbufsz, 0)) > 0) {
+        if (lc) checkLines(lc, rbuf, nr);
+        total += nr;
+    }
+    close(cfd);
+    if (lc && lc->len > 0) lc->bad = 1; // Unterminated last line
+    return nr == 0 ? total : -1;
+}
+
+static void *clientMain(void *vself) {
+    LoadClient *self = (LoadClient *)vself;
+    char *line = (char *)malloc(linesz);
+    char seekline[64];
+    size_t rbufsz = 1 << 16;
+    char *rbuf = (char *)malloc(rbufsz);
+
+    memset(line, 'a' + self->id % 26, linesz - 1);
+    line[linesz - 1] = '\n';
+
+    // Clients start staggered across one interval so paced sends interleave
+    double interval = rate > 0 ? 1e6 * nclients / rate : 0;
+    double start = nowus() + interval * self->id / nclients;
+    double deadline = start + duration * 1e6;
+
+    for (long i = 0; duration > 0 ? nowus() < deadline : i < nrequests; i++) {
+        double t0 = start + i * interval;
+        if (interval > 0) sleepUntil(t0);
+        else t0 = nowus();
+
+        RequestKind kind = REQ_DATA;
+        const char *req = line;
+        size_t reqsz = linesz;
+        long written = atomic_load(&linesWritten);
+        if (written > 0 && (int)(rand_r(&self->seed) % 100) < seekpct) {
+            kind = REQ_SEEKTO;
+            req = seekline;
+            reqsz = snprintf(seekline, sizeof(seekline), "AESDCHAR_IOCSEEKTO:%ld,%u\n",
+                rand_r(&self->seed) % written, rand_r(&self->seed) % (unsigned int)(linesz - 1));
+        }
+
+        // SEEKTO responses may start mid-line, only full contents are checked
+        LineCheck lc = { .uniform = 1 };
+        ssize_t nr = request(req, reqsz, rbuf, rbufsz, verify && kind == REQ_DATA ? &lc : NULL);
+        if (nr == -1 || addLatency(&self->lat[kind], nowus() - t0) == -1) {
+            self->nfail += 1;
+            continue;
+        }
+        self->nbad += lc.bad;
+        self->nrecv += nr;
+        if (kind == REQ_DATA) atomic_fetch_add(&linesWritten, 1);
+    }
+
+    free(rbuf);
+    free(line);
+    return NULL;
+}
+
+// Prints the server's metrics report, fetched like any other request
+static void printServerStats() {
+    static const char verb[] = "AESDSOCKET_STATS\n";
+    size_t rbufsz = 1 << 16;
+    char *rbuf = (char *)malloc(rbufsz);
+
+    int cfd = socket(server->ai_family, server->ai_socktype, server->ai_protocol);
+    if (cfd == -1 || connect(cfd, server->ai_addr, server->ai_addrlen) == -1 ||
+        send(cfd, verb, sizeof(verb) - 1, MSG_NOSIGNAL) != sizeof(verb) - 1) {
+        fprintf(stderr, "aesdload: server stats unavailable\n");
+    }
+    else {
+        shutdown(cfd, SHUT_WR);
+        ssize_t nr;
+        while ((nr = recv(cfd, rbuf, rbufsz, 0)) > 0) fwrite(rbuf, 1, nr, stdout);
+    }
+
+    if (cfd != -1) close(cfd);
+    free(rbuf);
+}
+
+static int cmpdouble(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const Latencies *sorted, double q) {
+    long i = (long)(sorted->n * q);
+    return sorted->v[i < sorted->n ? i : sorted->n - 1];
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:c:n:d:s:r:S:xv")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'c': nclients = strtol(optarg, NULL, 10); break;
+        case 'n': nrequests = strtol(optarg, NULL, 10); break;
+        case 'd': duration = strtod(optarg, NULL); break;
+        case 's': linesz = strtoul(optarg, NULL, 10); break;
+        case 'r': rate = strtod(optarg, NULL); break;
+        case 'S': seekpct = strtol(optarg, NULL, 10); break;
+        case 'x': serverstats = 1; break;
+        case 'v': verify = 1; break;
+        default: /* '?' */
+            printf("usage: aesdload [-h host] [-p port] [-c clients] [-n requests | -d seconds]\n");
+            printf("                [-s linesize] [-r rate] [-S seekpct] [-x] [-v]\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (nclients < 1 || nrequests < 1 || linesz < 2) {
+        fprintf(stderr, "aesdload: clients, requests must be >= 1 and linesize >= 2\n");
+        exit(EXIT_FAILURE);
+    }
+    else if (duration < 0 || rate < 0 || seekpct < 0 || seekpct > 100) {
+        fprintf(stderr, "aesdload: seconds, rate must be >= 0 and seekpct within 0-100\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(host, port, &hints, &server);
+    if (rc != 0) {
+        fprintf(stderr, "aesdload: getaddrinfo: %s\n", gai_strerror(rc));
+        exit(EXIT_FAILURE);
+    }
+
+    atomic_init(&linesWritten, 0);
+    LoadClient *clients = (LoadClient *)calloc(nclients, sizeof(LoadClient));
+    pthread_t *threads = (pthread_t *)calloc(nclients, sizeof(pthread_t));
+    unsigned int seed = (unsigned int)time(NULL);
+    double t0 = nowus();
+    for (long i = 0; i < nclients; i++) {
+        clients[i].id = i;
+        clients[i].seed = seed + i;
+        pthread_create(&threads[i], NULL, clientMain, &clients[i]);
+    }
+    for (long i = 0; i < nclients; i++) pthread_join(threads[i], NULL);
+    double elapsed = (nowus() - t0) / 1e6;
+
+    long nok = 0, nfail = 0, nbad = 0;
+    size_t nrecv = 0;
+    for (long i = 0; i < nclients; i++) {
+        nfail += clients[i].nfail;
+        nbad += clients[i].nbad;
+        nrecv += clients[i].nrecv;
+    }
+
+    // Merge each kind across clients, then sort once for its percentiles
+    Latencies all[NREQKINDS];
+    memset(all, 0, sizeof(all));
+    for (int k = 0; k < NREQKINDS; k++) {
+        for (long i = 0; i < nclients; i++) all[k].n += clients[i].lat[k].n;
+        all[k].v = (double *)malloc((all[k].n > 0 ? all[k].n : 1) * sizeof(double));
+        for (long i = 0, off = 0; i < nclients; i++) {
+            memcpy(&all[k].v[off], clients[i].lat[k].v, clients[i].lat[k].n * sizeof(double));
+            off += clients[i].lat[k].n;
+            free(clients[i].lat[k].v);
+        }
+        qsort(all[k].v, all[k].n, sizeof(double), cmpdouble);
+        nok += all[k].n;
+    }
+
+    printf("requests: %ld ok, %ld failed in %.3f s (%.0f req/s, %.1f MB/s received)\n",
+        nok, nfail, elapsed, nok / elapsed, nrecv / elapsed / 1e6);
+    for (int k = 0; k < NREQKINDS; k++) {
+        if (all[k].n > 0)
+            printf("%-8s: %ld, p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n", kindNames[k], all[k].n,
+                percentile(&all[k], 0.5), percentile(&all[k], 0.99), percentile(&all[k], 0.999),
+                all[k].v[all[k].n - 1]);
+        free(all[k].v);
+    }
+
+    if (verify) printf("verify  : %ld data responses with torn lines or unpublished data\n", nbad);
+    if (serverstats) printServerStats();
+
+    free(threads);
+    free(clients);
+    freeaddrinfo(server);
+    return nfail == 0 && nbad == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,44 +1,45 @@
 #include "connthread.h"
-
+#include "durable.h"
+#include "epollloop.h"
+#include "logger.h"
+#include "metrics.h"
+#include "registry.h"
+#include "seglog.h"
+#include "sigtimer.h"
+#include "threadpool.h"
+#include "uringloop.h"
+
+#include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <syslog.h>
-#include <sys/time.h>
+#include <sys/select.h>
 
 #define LPORT 9000
 #define BACKLOG 50
+#define POOLQDEPTH 64
+#define MAXSHARDS 64
+#define TSTAMPSEC 10 // Default timestamp interval (file and mem backends)
 
-// Uncomment to use aeschar device backend
-// Comment out to use regular var file backend
+// Uncomment to default to aeschar device backend
+// Comment out to default to regular var file backend
+// (either way -B file|chardev|mem picks one at runtime)
 #define USE_AESD_CHAR_DEVICE 1 
 
 #ifndef USE_AESD_CHAR_DEVICE
-#define BACKEND "/var/tmp/aesdsocketdata"
+#define DEFAULTBACKEND BACKEND_FILE
 #else
-#define BACKEND "/dev/aesdchar"
+#define DEFAULTBACKEND BACKEND_CHARDEV
 #endif
 
-// Global signal handler flags
-volatile sig_atomic_t _exitflag = 0;  // SIGINT/SIGTERM
-volatile sig_atomic_t _timerflag = 0; // SIGALRM
-
-void exitSigHandler(int sig) {
-    if (sig == SIGINT || sig == SIGTERM) _exitflag = 1;
-}
-
-void timerSigHandler(int sig) {
-    if (sig == SIGALRM) _timerflag = 1;
-}
-
 int becomeDaemon() {
     pid_t pid = getpid();
 
     // Fork and exit parent to go to background
     switch (fork()) {
     case -1: 
-        syslog(LOG_ERR, "ERROR in becomeDaemon::fork(2): %m");
+        logMsg(LOG_ERR, "ERROR in becomeDaemon::fork(2): %m");
         return -1;
     case 0: break;               // Child continues
     default: exit(EXIT_SUCCESS); // Parent terminates
@@ -46,14 +47,14 @@ int becomeDaemon() {
 
     // Start new session to shed controlling terminal
     if (setsid() == -1) {
-        syslog(LOG_ERR, "ERROR in becomeDaemon::setsid(2): %m");
+        logMsg(LOG_ERR, "ERROR in becomeDaemon::setsid(2): %m");
         return -1;
     }
 
     // Fork once more to shed session leader role
     switch (fork()) {
     case -1: 
-        syslog(LOG_ERR, "ERROR in becomeDaemon::fork(2): %m");
+        logMsg(LOG_ERR, "ERROR in becomeDaemon::fork(2): %m");
         return -1;
     case 0: break;
     default: exit(EXIT_SUCCESS);
@@ -61,42 +62,49 @@ int becomeDaemon() {
 
     int fd;
     if ((fd = open("/dev/null", O_RDWR)) == -1){
-        syslog(LOG_ERR, "ERROR in becomeDaemon::open(/dev/null): %m");
+        logMsg(LOG_ERR, "ERROR in becomeDaemon::open(/dev/null): %m");
         return -1;
     }
     // Point all STDXXX to /dev/null 
     else if ((dup2(fd, STDIN_FILENO) != STDIN_FILENO) || 
         (dup2(fd, STDOUT_FILENO) != STDOUT_FILENO) || 
         (dup2(fd, STDERR_FILENO) != STDERR_FILENO)) {
-        syslog(LOG_ERR, "ERROR in becomeDaemon::dup2(2): %m");
+        logMsg(LOG_ERR, "ERROR in becomeDaemon::dup2(2): %m");
         return -1;
     }
 
-    // No other files should be open yet except syslog
+    // No other files should be open yet except syslog and backend
     // Server listen port is bound should be inherited
 
     if (chdir("/") == -1) {
-        syslog(LOG_ERR, "ERROR in becomeDaemon::chdir(\"/\"): %m");
+        logMsg(LOG_ERR, "ERROR in becomeDaemon::chdir(\"/\"): %m");
         return -1;
     }
     closelog();
     openlog(NULL, LOG_PID, LOG_USER);
-    syslog(LOG_DEBUG, "Daemon tranformation complete (PID: %i => %i)", pid, getpid());
+    logMsg(LOG_DEBUG, "Daemon tranformation complete (PID: %i => %i)", pid, getpid());
     return 0;
 }
 
-int tcpListen() {
+// Opens the listen socket. With reuseport, several sockets can bind
+// LPORT and the kernel load-balances new connections across them.
+int tcpListen(int reuseport) {
     // Create a IPv4 TCP/steaming socket
     int sfd = socket(AF_INET , SOCK_STREAM, 0);
     if (sfd == -1) {
-        syslog(LOG_ERR, "ERROR in tcpListen::socket(2): %m");
+        logMsg(LOG_ERR, "ERROR in tcpListen::socket(2): %m");
         return -1;
     }
     
     // Set reuseaddr
     int optval = 1;
     if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) == -1) {
-        syslog(LOG_ERR, "ERROR in tcpListen::setsockopt(SO_REUSEADDR): %m");
+        logMsg(LOG_ERR, "ERROR in tcpListen::setsockopt(SO_REUSEADDR): %m");
+        close(sfd);
+        return -1;
+    }
+    else if (reuseport && setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) == -1) {
+        logMsg(LOG_ERR, "ERROR in tcpListen::setsockopt(SO_REUSEPORT): %m");
         close(sfd);
         return -1;
     }
@@ -110,160 +118,181 @@ int tcpListen() {
 
     // Bind server address to socket
     if(bind(sfd, (struct sockaddr *)&svaddr, sizeof(svaddr)) == -1) {
-        syslog(LOG_ERR, "ERROR in tcpListen::bind(%i, %i): %m", sfd, svaddr.sin_port);
+        logMsg(LOG_ERR, "ERROR in tcpListen::bind(%i, %i): %m", sfd, svaddr.sin_port);
         close(sfd);
         return -1;
     }
 
     // Mark socket as passive
     if(listen(sfd, BACKLOG) == -1) {
-        syslog(LOG_ERR, "ERROR in tcpListen::listen(%i): %m", sfd);
+        logMsg(LOG_ERR, "ERROR in tcpListen::listen(%i): %m", sfd);
         close(sfd);
         return -1;
     }
 
-    syslog(LOG_DEBUG, "Server listening on sfd: %i", sfd);
+    logMsg(LOG_DEBUG, "Server listening on sfd: %i", sfd);
     return sfd;
 }
 
-ConnThread *appendThread(ConnThread *head, ConnThread *ct) {
-    if (!head) head = ct;
-    else {
-        ConnThread *node = head;
-        while (node->next) node = node->next;
-        node->next = ct;
-    }
-    return head;
-}
-
-ConnThread *pruneDoneThreads(ConnThread *head) {
-    ConnThread *prv = NULL, *node = head;
-    int err, pcnt = 0;
-
-    while (node) {
-        ConnThread *nxt = node->next;
-        if (!node->_doneFlag) prv = node;
-        else {
-            syslog(LOG_DEBUG, "Joining thread %i in pruneDoneThreads", node->tid);
-            if ((err = pthread_join(node->thread, NULL)) != 0)
-                syslog(LOG_ERR, "ERROR in pruneDoneThreads::pthread_join(3): %s", strerror(err));
-
-            free(node);           
-            if (!prv) head = nxt;
-            else prv->next = nxt;
-            pcnt += 1;
+// Opens n listen sockets on LPORT, SO_REUSEPORT when sharded.
+// Returns sfds[0], or -1 on ERROR (with any opened sockets closed).
+int openListeners(int *sfds, int n) {
+    for (int i = 0; i < n; i++) {
+        if ((sfds[i] = tcpListen(n > 1)) == -1) {
+            while (i-- > 0) close(sfds[i]);
+            return -1;
         }
-        node = nxt;
     }
-
-    if (pcnt) syslog(LOG_DEBUG, "Pruned %i ConnThread nodes", pcnt);
-    return head;
+    return sfds[0];
 }
 
-ConnThread *termAllThreads(ConnThread *head) {
-    int err, pcnt = 0;
-    while (head) {
-        head->_exitflag = 1;
-        syslog(LOG_DEBUG, "Joining thread %i in termAllThreads", head->tid);
-        if ((err = pthread_join(head->thread, NULL)) != 0)
-            syslog(LOG_ERR, "ERROR in termAllThreads::pthread_join(3): %s", strerror(err));
-
-        ConnThread *nxt = head->next;
-        free(head);
-        head = nxt;
-        pcnt += 1;
-    }
-
-    syslog(LOG_DEBUG, "Terminated %i ConnThread nodes", pcnt);
-    return NULL;
+static void watchFd(int fd, fd_set *rfds, int *nfds) {
+    if (fd == -1) return;
+    FD_SET(fd, rfds);
+    if (fd >= *nfds) *nfds = fd + 1;
 }
 
-int eventLoop(int fd, int sfd) {
-    ConnThread *head = NULL;
+// Accepts clients on sfd, handing each to pool if non-NULL,
+// otherwise to a new thread (thread-per-connection). Runs until
+// sigfd reports SIGINT/SIGTERM, appending a timestamp to backend
+// whenever timerfd tfd expires (-1 for none).
+int eventLoop(const char *backend, int sfd, ThreadPool *pool, int sigfd, int tfd) {
+    ConnRegistry registry;
 
     int err;
     fd_set rfds;
-    struct timeval tv;
     int retstatus = 0;
+    int exiting = 0;
 
-    #ifndef USE_AESD_CHAR_DEVICE
-    // Set 10 sec timestamp signal timer
-    struct itimerval tstampinv;
-    tstampinv.it_value.tv_sec = 10;
-    tstampinv.it_value.tv_usec = 0;
-    tstampinv.it_interval.tv_sec = 10;
-    tstampinv.it_interval.tv_usec = 0;
-    if (setitimer(ITIMER_REAL, &tstampinv, NULL) == -1) {
-        syslog(LOG_ERR, "ERROR in eventLoop::setitimer(2): %m");
-        return -1;
-    }
-    #endif
+    if (initRegistry(&registry) == -1) return -1;
 
-    while (!_exitflag) { 
+    while (!exiting) {
+        int nfds = 0;
         FD_ZERO(&rfds);
-        FD_SET(sfd, &rfds);
-        tv.tv_sec = 2; // select loop interval
-        tv.tv_usec = 0;
-        
-        // Select on listen socket to avoid blocking signal deliveries
-        int ready = select(sfd+1, &rfds, NULL, NULL, &tv);
-        if (ready == -1) {
-            if (_exitflag) break;
-            else if (!_timerflag) {
-                syslog(LOG_ERR, "ERROR in eventLoop::select(2): %m");
-                retstatus = -1;
-                break;
-            }
+        watchFd(sigfd, &rfds, &nfds);
+        watchFd(tfd, &rfds, &nfds);
+        watchFd(registry.efd, &rfds, &nfds); // Finished connection threads
+
+        // Backpressure: while pool queue is full, leave clients in listen backlog
+        if (pool && !hasPoolSlot(pool)) watchFd(pool->slotfd, &rfds, &nfds);
+        else watchFd(sfd, &rfds, &nfds);
+
+        if (select(nfds, &rfds, NULL, NULL, NULL) == -1) {
+            if (errno == EINTR) continue;
+            logMsg(LOG_ERR, "ERROR in eventLoop::select(2): %m");
+            retstatus = -1;
+            break;
+        }
+
+        if (FD_ISSET(sigfd, &rfds) && readExitSignal(sigfd)) {
+            exiting = 1;
+            break;
+        }
+
+        // Write timestamp to backend if timer expired
+        if (tfd != -1 && FD_ISSET(tfd, &rfds) && readTimer(tfd) > 0 && writeTimestamp(backend) == -1) {
+            retstatus = -1;
+            break;
         }
-        else if (ready) {
-            // Accept new client connection
-            ConnThread *ct = newConnThread(BACKEND);
+
+        // Free finished connections as soon as their threads signal
+        if (FD_ISSET(registry.efd, &rfds)) reapDoneConns(&registry);
+        if (!FD_ISSET(sfd, &rfds)) continue;
+
+        if (pool) {
+            // Accept new client connection and queue it for pool workers
+            PendingConn pc;
             socklen_t addrlen = sizeof(struct sockaddr_storage);
-            if ((ct->cfd = accept(sfd, (struct sockaddr *)&ct->claddr, &addrlen)) == -1) {
-                syslog(LOG_ERR, "ERROR in eventLoop::accept(2): %m");
+            if ((pc.cfd = accept(sfd, (struct sockaddr *)&pc.claddr, &addrlen)) == -1) {
+                logMsg(LOG_ERR, "ERROR in eventLoop::accept(2): %m");
                 retstatus = -1;
-                free(ct);
                 break;
             }
-            // Create thread for new connection
-            else if ((err = pthread_create(&ct->thread, NULL, connThreadMain, ct)) != 0) {
-                syslog(LOG_ERR, "ERROR in eventLoop::pthread_create(3): %s", strerror(err));
+            countMetric(M_ACCEPTED, 1);
+            if (submitConn(pool, &pc) == -1) {
                 retstatus = -1;
-                free(ct);
+                close(pc.cfd);
+                countMetric(M_CLOSED, 1);
                 break;
             }
-            else head = appendThread(head, ct);
+            continue;
         }
 
-        #ifndef USE_AESD_CHAR_DEVICE
-        // Write timestamp to BACKEND if timer expired
-        if (_timerflag && !(_timerflag = 0) && writeTimestamp(BACKEND) == -1) {
+        // Accept new client connection
+        ConnThread *ct = newConnThread(backend);
+        socklen_t addrlen = sizeof(struct sockaddr_storage);
+        if (ct == NULL) {
             retstatus = -1;
             break;
         }
-        #endif
+        else if ((ct->cfd = accept(sfd, (struct sockaddr *)&ct->claddr, &addrlen)) == -1) {
+            logMsg(LOG_ERR, "ERROR in eventLoop::accept(2): %m");
+            retstatus = -1;
+            freeConnThread(ct);
+            break;
+        }
 
-        // Prune every loop iteration
-        head = pruneDoneThreads(head);
+        // Register before the thread starts, it may finish right away
+        countMetric(M_ACCEPTED, 1);
+        registerConn(&registry, ct);
+        if ((err = pthread_create(&ct->thread, NULL, connThreadMain, ct)) != 0) {
+            logMsg(LOG_ERR, "ERROR in eventLoop::pthread_create(3): %s", strerror(err));
+            retstatus = -1;
+            unregisterConn(&registry, ct);
+            close(ct->cfd);
+            countMetric(M_CLOSED, 1);
+            freeConnThread(ct);
+            break;
+        }
     }
 
-    if (_exitflag) { 
-        head = termAllThreads(head);
-        syslog(LOG_DEBUG, "Caught signal, exiting");
-        retstatus = 0;
-    }
+    termAllConns(&registry);
+    destroyRegistry(&registry);
+    if (exiting) logMsg(LOG_DEBUG, "Caught signal, exiting");
     return retstatus;
 }
 
+static void usage() {
+    printf("usage: aesdsocket [-d] [-k] [-e] [-u] [-b] [-p poolsize] [-q queuedepth]\n"
+        "                  [-s shards] [-o outlimit] [-O disconnect|truncate] [-t interval]\n"
+        "                  [-B file|chardev|mem] [-L level] [-D window_us] [-G maxbatch]\n"
+        "                  [-S segbytes] [-R retainbytes] [-A retainsec] [-Z level]\n"
+        "                  [-H histbytes]\n");
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char *argv[]) {
     int opt;
     int isdaemon = 0;
     int keepbackend = 0;
-    int fd = -1, sfd = -1;
+    int useepoll = 0;
+    int useuring = 0;
+    long tstampsec = -1;
+    long durablewin = -1;
+    long maxbatch = DURABLEBATCH;
+    int segmented = 0;
+    size_t segbytes = SEGSIZE;
+    size_t retainbytes = 0;
+    size_t histbytes = HISTMAXSZ;
+    long retainsec = 0;
+    int zlevel = 0;
+    long poolsz = 0;
+    long qdepth = POOLQDEPTH;
+    int nshards = 1;
+    int sfds[MAXSHARDS];
+    size_t outlimit = 0;
+    LagPolicy lagpolicy = LAG_DISCONNECT;
+    ThreadPool *pool = NULL;
+    History *hist = NULL;
+    SeekIndex *seekindex = NULL;
+    BackendKind kind = DEFAULTBACKEND;
+    Backend *store = NULL;
+    int sfd = -1;
+    int sigfd = -1, tfd = -1;
     int status = EXIT_SUCCESS;
 
     // Handle command line 
-    while ((opt = getopt(argc, argv, "dk")) != -1) {
+    while ((opt = getopt(argc, argv, "dkeubp:q:o:O:s:t:B:L:D:G:S:R:A:Z:H:")) != -1) {
         switch (opt) {
         case 'd':
             isdaemon = 1;
@@ -271,44 +300,225 @@ int main(int argc, char *argv[]) {
         case 'k':
             keepbackend = 1;
             break;
+        case 'e':
+            useepoll = 1;
+            break;
+        case 'u':
+            useuring = 1;
+            break;
+        case 'b':
+            enableBatching(1);
+            break;
+        case 'p':
+            poolsz = strtol(optarg, NULL, 10);
+            break;
+        case 'q':
+            if ((qdepth = strtol(optarg, NULL, 10)) < 1) qdepth = POOLQDEPTH;
+            break;
+        case 's':
+            if ((nshards = strtol(optarg, NULL, 10)) < 1) nshards = 1;
+            else if (nshards > MAXSHARDS) nshards = MAXSHARDS;
+            useepoll = 1; // Shards are epoll event loops
+            break;
+        case 'o':
+            outlimit = strtoul(optarg, NULL, 10);
+            break;
+        case 'O':
+            lagpolicy = strcmp(optarg, "truncate") == 0 ? LAG_TRUNCATE : LAG_DISCONNECT;
+            break;
+        case 't':
+            tstampsec = strtol(optarg, NULL, 10); // 0 disables timestamps
+            break;
+        case 'B':
+            if (parseBackendKind(optarg, &kind) == -1) usage();
+            break;
+        case 'L':
+            if (parseLogLevel(optarg, &logLevel) == -1) usage();
+            break;
+        case 'D':
+            if ((durablewin = strtol(optarg, NULL, 10)) < 0) durablewin = 0;
+            break;
+        case 'G':
+            if ((maxbatch = strtol(optarg, NULL, 10)) < 1) maxbatch = DURABLEBATCH;
+            break;
+        case 'S':
+            if ((segbytes = strtoul(optarg, NULL, 10)) == 0) segbytes = SEGSIZE;
+            segmented = 1;
+            break;
+        case 'R':
+            retainbytes = strtoul(optarg, NULL, 10); // 0 keeps any size
+            segmented = 1;
+            break;
+        case 'A':
+            if ((retainsec = strtol(optarg, NULL, 10)) < 0) retainsec = 0;
+            segmented = 1;
+            break;
+        case 'Z':
+            zlevel = strtol(optarg, NULL, 10); // zlib levels, fastest to smallest
+            if (zlevel < 1 || zlevel > 9) usage();
+            segmented = 1;
+            break;
+        case 'H':
+            histbytes = strtoul(optarg, NULL, 10); // 0 disables the mirror
+            break;
         default: /* '?' */
-            printf("usage: aesdsocket [-d] [-k]\n");
-            exit(EXIT_FAILURE);
+            usage();
         }
     }
     
     // Init syslog params
     openlog(NULL, LOG_PID, LOG_USER);
+    initMetrics();
+
+    const char *backend = backendPath(kind);
+    // Segments and retention apply to the file backend only
+    if (segmented && kind != BACKEND_FILE) {
+        logMsg(LOG_INFO, "Segmented log needs the file backend, ignoring -S/-R/-A/-Z");
+        segmented = 0;
+    }
+    // A compressed segment's block index lives in memory only, so the
+    // segmented log starts empty every run and is removed at exit
+    else if (segmented && keepbackend) {
+        logMsg(LOG_INFO, "Segmented log is not kept across runs, ignoring -k");
+        keepbackend = 0;
+    }
+    // With -k a plain file backend and its index are served again, else
+    // start empty in case -k was used previously
+    int reload = kind == BACKEND_FILE && keepbackend;
+    if (kind == BACKEND_FILE && !reload) remove(backend);
+    if (kind == BACKEND_FILE && !reload) removeSeekIndex(backend);
+    if (kind == BACKEND_FILE) removeSegments(backend);
+    if (tstampsec == -1) tstampsec = kind == BACKEND_CHARDEV ? 0 : TSTAMPSEC;
+
+    // Shards are epoll event loops, each accepting on its own socket
+    if (nshards > 1) useuring = 0;
+
+    // Probe io_uring support at runtime, the epoll engine stands in without it
+    if (useuring && probeUring() == -1) {
+        logMsg(LOG_INFO, "io_uring unavailable, falling back to epoll engine");
+        useuring = 0;
+        useepoll = 1;
+    }
+    // io_uring appends and reads go to the backend fd, the mem store has none
+    else if (useuring && kind == BACKEND_MEM) {
+        logMsg(LOG_INFO, "io_uring needs an fd backend, using epoll engine for mem");
+        useuring = 0;
+        useepoll = 1;
+    }
+    // nor does a segmented log, which spans many files
+    else if (useuring && segmented) {
+        logMsg(LOG_INFO, "io_uring needs an fd backend, using epoll engine for segments");
+        useuring = 0;
+        useepoll = 1;
+    }
+
+    // Group commit only makes sense for the file backend
+    if (durablewin >= 0 && kind != BACKEND_FILE) {
+        logMsg(LOG_INFO, "Durable mode needs the file backend, ignoring -D");
+        durablewin = -1;
+    }
+    // io_uring completes appends in the ring, durable mode holds responses in the epoll engine
+    else if (durablewin >= 0 && useuring) {
+        logMsg(LOG_INFO, "Durable mode uses the epoll engine in place of io_uring");
+        useuring = 0;
+        useepoll = 1;
+    }
 
-    #ifndef USE_AESD_CHAR_DEVICE
-    remove(BACKEND); // In case -k was used previously
-    #endif
+    // Only the epoll engine queues output per client, so only it can bound it
+    if (outlimit > 0 && useuring) {
+        logMsg(LOG_INFO, "Output limit uses the epoll engine in place of io_uring");
+        useuring = 0;
+        useepoll = 1;
+    }
+    else if (outlimit > 0 && !useepoll) {
+        logMsg(LOG_INFO, "Output limit needs the epoll engine, ignoring -o/-O");
+        outlimit = 0;
+    }
+
+    // The worker pool serves thread-per-connection only, event loops own their clients
+    if (poolsz > 0 && (useuring || useepoll)) {
+        logMsg(LOG_INFO, "Worker pool needs the thread engine, ignoring -p/-q");
+        poolsz = 0;
+    }
+
+    // Bound per-client queued output (epoll engine)
+    setOutputLimit(outlimit, lagpolicy);
+
+    // Mirror backend in memory up to histbytes (regular file only, the mem
+    // store is memory, and a whole-content mirror would outlive segment retention)
+    if (kind == BACKEND_FILE && !segmented && histbytes > 0) attachHistory(hist = newHistory(backend, histbytes));
     
-    // Add signal handler for SIGINT/SIGTERM/SIGALRM
-    if ((signal(SIGINT, exitSigHandler) == SIG_ERR) || 
-        (signal(SIGTERM, exitSigHandler) == SIG_ERR) || 
-        (signal(SIGALRM, timerSigHandler) == SIG_ERR)) {
-        syslog(LOG_ERR, "ERROR in main::signal(SIGINT/SIGTERM/SIGALRM): %m");
+    // Open shared backend and publish its initial end offset
+    if (segmented) store = newSegmentedBackend(backend, segbytes, retainbytes, retainsec);
+    else store = newBackend(kind, backend);
+    if (store == NULL || attachBackend(store) == -1) {
+        status = EXIT_FAILURE;
+    }
+    // Index write commands so SEEKTO resolves in O(1) (the driver keeps its
+    // own), persisted next to a plain file backend kept for the next run
+    else if (store->ordered && attachSeekIndex(seekindex = newSeekIndex(store,
+        reload ? backend : NULL)) == -1) {
+        status = EXIT_FAILURE;
+    }
+    // Route SIGINT/SIGTERM through a signalfd; blocked before any
+    // thread is spawned, so every thread inherits the mask
+    else if ((sigfd = openSignalFd()) == -1) {
         status = EXIT_FAILURE;
     }
     // Listen for clients
-    else if ((sfd = tcpListen()) == -1) {
+    else if ((sfd = openListeners(sfds, nshards)) == -1) {
         status = EXIT_FAILURE;
     }
     // Fork to daemon only after binding listen port 
     else if (isdaemon && (becomeDaemon() == -1))  {
         status = EXIT_FAILURE;
     }
-    // Loop forever
-    else if (eventLoop(fd, sfd) == -1)  {
+    // Start the log flusher and worker pool only after fork, threads do not survive it
+    else if (startLogging() == -1) {
+        status = EXIT_FAILURE;
+    }
+    else if (durablewin >= 0 && startDurable(store, durablewin, maxbatch) == -1) {
+        status = EXIT_FAILURE;
+    }
+    // Compress sealed segments in the background
+    else if (segmented && zlevel > 0 && startPacking(store, zlevel) == -1) {
+        status = EXIT_FAILURE;
+    }
+    else if (poolsz > 0 && (pool = newThreadPool(poolsz, qdepth, backend)) == NULL) {
+        status = EXIT_FAILURE;
+    }
+    // Start timestamp timer (default on for all but the char device)
+    else if (tstampsec > 0 && (tfd = openTimestampTimer(tstampsec)) == -1)  {
+        status = EXIT_FAILURE;
+    }
+    // Loop forever, with io_uring engine, epoll engine or thread-per-connection
+    else if (useuring && (uringEventLoop(sfd, backend, sigfd, tfd) == -1))  {
+        status = EXIT_FAILURE;
+    }
+    else if (!useuring && useepoll && (epollEventLoop(sfds, nshards, backend, sigfd, tfd) == -1))  {
+        status = EXIT_FAILURE;
+    }
+    else if (!useuring && !useepoll && (eventLoop(backend, sfd, pool, sigfd, tfd) == -1))  {
         status = EXIT_FAILURE;
     }
 
+    if (pool) shutdownThreadPool(pool);
+    stopDurable();
+    if (hist) destroyHistory(hist);
+    if (seekindex) destroySeekIndex(seekindex);
+    if (store) destroyBackend(store);
+    if (tfd != -1) close(tfd);
+    if (sigfd != -1) close(sigfd);
+    logPoolStats();
+    destroyPools();
+
+    stopLogging();
     closelog(); 
-    if (sfd != -1) close(sfd);
-    #ifndef USE_AESD_CHAR_DEVICE
-    if (!keepbackend) remove(BACKEND);
-    #endif
+    for (int i = 0; sfd != -1 && i < nshards; i++) close(sfds[i]);
+    // Char device backend is never removed
+    if (kind == BACKEND_FILE && !keepbackend) remove(backend);
+    if (kind == BACKEND_FILE && !keepbackend) removeSeekIndex(backend);
+    if (segmented && !keepbackend) removeSegments(backend);
     exit(status);
 }
 
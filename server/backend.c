@@ -0,0 +1,301 @@
+#include "backend.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SCANBLK 65536
+
+
+// Positional write of all n bytes. Returns n, or -1 on ERROR.
+static ssize_t fdAppend(Backend *self, const char *data, size_t n, off_t off) {
+    size_t numWrite = 0;
+
+    while (numWrite < n) {
+        ssize_t nw = pwrite(self->fd, data + numWrite, n - numWrite, off + numWrite);
+        if (nw == -1 && errno == EINTR) continue;
+        else if (nw <= 0) return -1;
+        numWrite += nw;
+    }
+    return numWrite;
+}
+
+// Records the highest byte written, appends may finish out of order
+static void advanceMemEnd(Backend *self, off_t end) {
+    off_t cur = atomic_load(&self->memEnd);
+    while (cur < end && !atomic_compare_exchange_weak(&self->memEnd, &cur, end)) ;
+}
+
+// Mapped bytes are readable once written: below memEnd the file is at
+// least that long, so the mapping never faults past EOF
+static ssize_t fileAppend(Backend *self, const char *data, size_t n, off_t off) {
+    ssize_t numWrite = fdAppend(self, data, n, off);
+    if (numWrite != -1 && self->mem) advanceMemEnd(self, off + n);
+    return numWrite;
+}
+
+static ssize_t fdRead(Backend *self, char *buf, size_t n, off_t off) {
+    ssize_t numRead;
+    while ((numRead = pread(self->fd, buf, n, off)) == -1 && errno == EINTR) ;
+    return numRead;
+}
+
+// Offset of the seekto->write_cmd'th line plus write_cmd_offset,
+// scanning [base, end) the way the driver counts its write commands
+off_t scanSeekto(Backend *self, const struct aesd_seekto *seekto, off_t end) {
+    char block[SCANBLK];
+    uint32_t cmd = 0;
+    off_t start = atomic_load(&self->base), off = start;
+
+    while (off < end) {
+        size_t want = (end - off) < SCANBLK ? (size_t)(end - off) : SCANBLK;
+        size_t nmapped;
+        void *pin = NULL;
+        const char *buf = self->ops->view(self, off, off + want, &nmapped, &pin);
+        ssize_t numRead = buf ? (ssize_t)nmapped : self->ops->read(self, block, want, off);
+        if (buf == NULL) buf = block;
+        if (numRead <= 0) break;
+
+        off_t pos = -1;
+        for (const char *p = buf, *eol; (eol = memchr(p, '\n', buf + numRead - p)); p = eol + 1) {
+            off_t next = off + (eol - buf) + 1;
+            if (cmd++ == seekto->write_cmd) {
+                if (seekto->write_cmd_offset < next - start) pos = start + seekto->write_cmd_offset;
+                break;
+            }
+            start = next;
+        }
+        self->ops->release(self, pin);
+        if (pos != -1) return pos;
+        else if (cmd > seekto->write_cmd) break;
+        off += numRead;
+    }
+
+    // Unterminated last write counts as a command too
+    if (cmd == seekto->write_cmd && start < end && seekto->write_cmd_offset < end - start)
+        return start + seekto->write_cmd_offset;
+    errno = EINVAL;
+    return -1;
+}
+
+static off_t fileSize(Backend *self) {
+    struct stat st;
+    if (fstat(self->fd, &st) == -1) return -1;
+    return st.st_size;
+}
+
+static int fileFlush(Backend *self) {
+    return fdatasync(self->fd);
+}
+
+// Stores without retention keep everything
+int noTrim(Backend *self, off_t end) {
+    (void)self;
+    (void)end;
+    return 0;
+}
+
+// Mapped content (mem store, regular file) lies below memEnd, the
+// highest byte written: a failed append publishes a range it never
+// wrote, and the file mapping would fault past EOF. A file grown past
+// the mapping is read beyond it.
+static const char *memView(Backend *self, off_t off, off_t end, size_t *n, void **pin) {
+    off_t written = atomic_load(&self->memEnd);
+    off_t stop = end < written ? end : written;
+    if ((uint64_t)stop > MEMBACKENDMAX) stop = MEMBACKENDMAX;
+
+    *pin = NULL;
+    if (self->mem == NULL || off >= stop) return NULL;
+    *n = stop - off;
+    return self->mem + off;
+}
+
+// Views of a mapping that never moves need no release
+void noRelease(Backend *self, void *pin) {
+    (void)self;
+    (void)pin;
+}
+
+// Nor does content that is never dropped need holding
+off_t noHold(Backend *self, off_t off, long *token) {
+    (void)self;
+    *token = -1;
+    return off;
+}
+
+void noUnhold(Backend *self, long token) {
+    (void)self;
+    (void)token;
+}
+
+static void fdClose(Backend *self) {
+    close(self->fd);
+}
+
+static void fileClose(Backend *self) {
+    if (self->mem) munmap(self->mem, MEMBACKENDMAX);
+    close(self->fd);
+}
+
+static const BackendOps fileOps = {
+    fileAppend, fdRead, scanSeekto, fileSize, fileFlush, noTrim, memView, noRelease, noHold, noUnhold, fileClose
+};
+
+// The driver keeps the write commands, SEEKTO is its ioctl. The shared
+// f_pos it sets is read back under seekLock.
+static off_t chardevSeekto(Backend *self, const struct aesd_seekto *seekto, off_t end) {
+    off_t pos = -1;
+    (void)end;
+
+    pthread_mutex_lock(&self->seekLock);
+    if (ioctl(self->fd, AESDCHAR_IOCSEEKTO, seekto) != -1) pos = lseek(self->fd, 0, SEEK_CUR);
+    pthread_mutex_unlock(&self->seekLock);
+    return pos;
+}
+
+static off_t chardevSize(Backend *self) {
+    pthread_mutex_lock(&self->seekLock);
+    off_t end = lseek(self->fd, 0, SEEK_END);
+    pthread_mutex_unlock(&self->seekLock);
+    return end;
+}
+
+static int chardevFlush(Backend *self) {
+    (void)self;
+    return 0;
+}
+
+static const BackendOps chardevOps = {
+    fdAppend, fdRead, chardevSeekto, chardevSize, chardevFlush, noTrim, memView, noRelease, noHold, noUnhold, fdClose
+};
+
+static ssize_t memAppend(Backend *self, const char *data, size_t n, off_t off) {
+    if ((size_t)off + n > MEMBACKENDMAX) {
+        errno = ENOSPC;
+        return -1;
+    }
+    memcpy(self->mem + off, data, n);
+    advanceMemEnd(self, off + n);
+    return n;
+}
+
+static ssize_t memRead(Backend *self, char *buf, size_t n, off_t off) {
+    off_t end = atomic_load(&self->memEnd);
+    if (off >= end) return 0;
+    if ((off_t)n > end - off) n = end - off;
+    memcpy(buf, self->mem + off, n);
+    return n;
+}
+
+static off_t memSize(Backend *self) {
+    return atomic_load(&self->memEnd);
+}
+
+static int memFlush(Backend *self) {
+    (void)self;
+    return 0;
+}
+
+static void memClose(Backend *self) {
+    munmap(self->mem, MEMBACKENDMAX);
+}
+
+static const BackendOps memOps = {
+    memAppend, memRead, scanSeekto, memSize, memFlush, noTrim, memView, noRelease, noHold, noUnhold, memClose
+};
+
+// Maps the regular file read-only over MEMBACKENDMAX of address space,
+// so the mapping covers later appends without ever moving under
+// readers. Reads fall back to pread(2) if it cannot be mapped.
+static void mapFile(Backend *self) {
+    struct stat st;
+    if (fstat(self->fd, &st) == -1) {
+        logMsg(LOG_ERR, "ERROR in mapFile::fstat(%s): %m", self->path);
+        return;
+    }
+
+    void *mem = mmap(NULL, MEMBACKENDMAX, PROT_READ, MAP_SHARED, self->fd, 0);
+    if (mem == MAP_FAILED) {
+        logMsg(LOG_ERR, "ERROR in mapFile::mmap(%s): %m", self->path);
+        return;
+    }
+    // Responses stream the content front to back
+    if (madvise(mem, MEMBACKENDMAX, MADV_SEQUENTIAL) == -1)
+        logMsg(LOG_ERR, "ERROR in mapFile::madvise(%s): %m", self->path);
+
+    atomic_store(&self->memEnd, st.st_size);
+    self->mem = (char *)mem;
+}
+
+// Maps a -B argument to its BackendKind. Returns -1 if unknown.
+int parseBackendKind(const char *name, BackendKind *kind) {
+    if (strcmp(name, "file") == 0) *kind = BACKEND_FILE;
+    else if (strcmp(name, "chardev") == 0) *kind = BACKEND_CHARDEV;
+    else if (strcmp(name, "mem") == 0) *kind = BACKEND_MEM;
+    else return -1;
+    return 0;
+}
+
+const char *backendPath(BackendKind kind) {
+    switch (kind) {
+    case BACKEND_CHARDEV: return CHARBACKEND;
+    case BACKEND_MEM: return MEMBACKEND;
+    case BACKEND_FILE:
+    default: return FILEBACKEND;
+    }
+}
+
+Backend *newBackend(BackendKind kind, const char *path) {
+    Backend *self = (Backend *)calloc(1, sizeof(Backend));
+    if (self == NULL) {
+        logMsg(LOG_ERR, "ERROR in newBackend::calloc(3): %m");
+        return NULL;
+    }
+
+    self->kind = kind;
+    self->path = path;
+    self->fd = -1;
+    self->ordered = kind != BACKEND_CHARDEV;
+    atomic_init(&self->memEnd, 0);
+    atomic_init(&self->base, 0);
+
+    if (kind == BACKEND_MEM) {
+        // Reserve address space once so content never moves under readers,
+        // pages are only backed as appends touch them
+        self->ops = &memOps;
+        self->mem = mmap(NULL, MEMBACKENDMAX, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if (self->mem == MAP_FAILED) {
+            logMsg(LOG_ERR, "ERROR in newBackend::mmap(2): %m");
+            free(self);
+            return NULL;
+        }
+    }
+    else {
+        self->ops = kind == BACKEND_CHARDEV ? &chardevOps : &fileOps;
+        if ((self->fd = open(path, O_CREAT|O_RDWR|O_CLOEXEC, 0644)) == -1) {
+            logMsg(LOG_ERR, "ERROR in newBackend::open(%s) %m", path);
+            free(self);
+            return NULL;
+        }
+        if (kind == BACKEND_FILE) mapFile(self);
+    }
+
+    pthread_mutex_init(&self->seekLock, NULL);
+    logMsg(LOG_DEBUG, "Opened %s backend %s", kind == BACKEND_MEM ? "mem" :
+        kind == BACKEND_CHARDEV ? "chardev" : "file", path);
+    return self;
+}
+
+// Flushes, closes and frees the backend
+void destroyBackend(Backend *self) {
+    if (self->ops->flush(self) == -1)
+        logMsg(LOG_ERR, "ERROR in destroyBackend::flush(%s): %m", self->path);
+    self->ops->close(self);
+    pthread_mutex_destroy(&self->seekLock);
+    free(self);
+}
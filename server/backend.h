@@ -0,0 +1,102 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define FILEBACKEND "/var/tmp/aesdsocketdata"
+#define CHARBACKEND "/dev/aesdchar"
+#define MEMBACKEND "mem"
+// Address space reserved by the mem store and file map
+#if SIZE_MAX > 0xffffffffu
+#define MEMBACKENDMAX ((size_t)1 << 32)
+#else
+#define MEMBACKENDMAX ((size_t)1 << 30)
+#endif
+
+/*
+    Storage engine kind, selected at runtime (-B file|chardev|mem):
+    FILE appends to a regular file, CHARDEV to the aesdchar driver
+    (which keeps only its last writes and resolves SEEKTO by ioctl),
+    MEM to an anonymous in-process mapping that dies with the server.
+*/
+typedef enum { BACKEND_FILE, BACKEND_CHARDEV, BACKEND_MEM } BackendKind;
+
+typedef struct Backend Backend;
+typedef struct SegLog SegLog;
+
+/*
+    Backend operations. append writes n bytes at the offset reserved
+    for them (concurrent appends never overlap), read fills buf from
+    off and returns 0 past the end. seekto resolves a SEEKTO command
+    to an absolute offset within the first end bytes (the published
+    content), -1 with errno EINVAL when out of range. size reports
+    the end offset as the store sees it, flush forces appended data
+    to stable storage. trim applies the retention policy once the
+    content up to end is published (a no-op unless segmented). view
+    returns the content at off straight from the store's mapping,
+    with *n set to the bytes readable there below end, or NULL where
+    nothing is mapped (read it instead). The view stays valid until
+    release(pin), even if retention drops its segment meanwhile.
+    hold keeps retention from moving base past off, raised to base
+    first and returned, until unhold(token), so a response being sent
+    never loses the rest of its range (token -1 where nothing is held).
+*/
+typedef struct {
+    ssize_t (*append)(Backend *self, const char *data, size_t n, off_t off);
+    ssize_t (*read)(Backend *self, char *buf, size_t n, off_t off);
+    off_t (*seekto)(Backend *self, const struct aesd_seekto *seekto, off_t end);
+    off_t (*size)(Backend *self);
+    int (*flush)(Backend *self);
+    int (*trim)(Backend *self, off_t end);
+    const char *(*view)(Backend *self, off_t off, off_t end, size_t *n, void **pin);
+    void (*release)(Backend *self, void *pin);
+    off_t (*hold)(Backend *self, off_t off, long *token);
+    void (*unhold)(Backend *self, long token);
+    void (*close)(Backend *self);
+} BackendOps;
+
+/*
+    Open storage engine shared by every connection. fd is the file
+    behind it, for engines that send or write it directly (sendfile,
+    splice, io_uring), -1 for the mem store. mem is the mem store, or
+    a read-only shared mapping of the regular file (NULL otherwise),
+    readable through view below memEnd, the highest byte written,
+    and MEMBACKENDMAX, past which the file is read instead.
+    ordered is set when appends land at their reserved offsets, so
+    the end offset can be tracked in memory instead of asked for.
+    log is the segmented log behind a segmented file store (NULL
+    otherwise, fd is then -1), base the offset of the oldest content
+    it retains (0 for every other store).
+*/
+struct Backend {
+    const BackendOps *ops;
+    BackendKind kind;
+    const char *path;
+    int fd;
+    int ordered;
+
+    char *mem;
+    _Atomic off_t memEnd;
+
+    SegLog *log;
+    _Atomic off_t base;
+
+    pthread_mutex_t seekLock; // Pairs the chardev ioctl with its lseek
+};
+
+int parseBackendKind(const char *name, BackendKind *kind);
+const char *backendPath(BackendKind kind);
+Backend *newBackend(BackendKind kind, const char *path);
+off_t scanSeekto(Backend *self, const struct aesd_seekto *seekto, off_t end);
+int noTrim(Backend *self, off_t end);
+void noRelease(Backend *self, void *pin);
+off_t noHold(Backend *self, off_t off, long *token);
+void noUnhold(Backend *self, long token);
+void destroyBackend(Backend *self);
+
+#endif /* BACKEND_H */
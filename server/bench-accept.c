@@ -0,0 +1,93 @@
+/*
+    Accept-rate benchmark for aesdsocket (e.g. -s N shards): -c client
+    threads open connections for -t seconds. Each connection half-closes
+    without sending data and waits for the server to accept, see EOF and
+    close, so a completed cycle is one full accept. Closes with RST to
+    avoid TIME_WAIT port exhaustion. Reports accepts per second.
+
+    usage: bench-accept [-h host] [-p port] [-c clients] [-t seconds]
+*/
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static struct addrinfo *server;
+static atomic_int stop = 0;
+static atomic_long ncycles = 0, nfailed = 0;
+
+
+static int acceptCycle() {
+    int cfd = socket(server->ai_family, server->ai_socktype, server->ai_protocol);
+    if (cfd == -1) return -1;
+
+    struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+    setsockopt(cfd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+
+    char byte;
+    int status = -1;
+    if (connect(cfd, server->ai_addr, server->ai_addrlen) == 0 &&
+        shutdown(cfd, SHUT_WR) == 0 && recv(cfd, &byte, 1, 0) == 0) status = 0;
+    close(cfd);
+    return status;
+}
+
+static void *clientMain(void *unused) {
+    (void)unused;
+    while (!atomic_load(&stop)) {
+        if (acceptCycle() == 0) atomic_fetch_add(&ncycles, 1);
+        else atomic_fetch_add(&nfailed, 1);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = "127.0.0.1", *port = "9000";
+    long nclients = 8, seconds = 3;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:c:t:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'c': nclients = strtol(optarg, NULL, 10); break;
+        case 't': seconds = strtol(optarg, NULL, 10); break;
+        default: /* '?' */
+            printf("usage: bench-accept [-h host] [-p port] [-c clients] [-t seconds]\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (nclients < 1 || seconds < 1) {
+        fprintf(stderr, "bench-accept: clients and seconds must be >= 1\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(host, port, &hints, &server);
+    if (rc != 0) {
+        fprintf(stderr, "bench-accept: getaddrinfo: %s\n", gai_strerror(rc));
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_t *threads = (pthread_t *)calloc(nclients, sizeof(pthread_t));
+    for (long i = 0; i < nclients; i++) pthread_create(&threads[i], NULL, clientMain, NULL);
+    sleep(seconds);
+    atomic_store(&stop, 1);
+    for (long i = 0; i < nclients; i++) pthread_join(threads[i], NULL);
+
+    printf("accepts: %ld in %ld s (%.0f/s), %ld failed, %ld clients\n",
+        atomic_load(&ncycles), seconds, (double)atomic_load(&ncycles) / seconds,
+        atomic_load(&nfailed), nclients);
+
+    free(threads);
+    freeaddrinfo(server);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,99 @@
+/*
+    Microbenchmark of control line recognition: parseCommand() dispatch
+    table versus the former regcomp-per-line matchIoctl() path (and the
+    same regex compiled once, for reference).
+
+    usage: bench-command [lines] [percent seekto lines]
+*/
+#include "command.h"
+
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NSAMPLES 1024
+
+
+// Former matchIoctl() body: compiles (and leaks) a regex on every line
+static int regexPerLine(const char *line, struct aesd_seekto *pSeekObj) {
+    regex_t regex;
+    regmatch_t groups[3];
+    char digit[64];
+    size_t n;
+
+    regcomp(&regex, "^AESDCHAR_IOCSEEKTO:([0-9]+),([0-9]+)", REG_EXTENDED);
+    if (regexec(&regex, line, 3, groups, 0) == REG_NOMATCH) return 0;
+
+    n = groups[1].rm_eo - groups[1].rm_so;
+    memset((void *)digit, 0, n+1);
+    stpncpy(digit, &line[groups[1].rm_so], n);
+    pSeekObj->write_cmd = (uint32_t)atoi((const char *)digit);
+
+    n = groups[2].rm_eo - groups[2].rm_so;
+    memset((void *)digit, 0, n+1);
+    stpncpy(digit, &line[groups[2].rm_so], n);
+    pSeekObj->write_cmd_offset = (uint32_t)atoi((const char *)digit);
+    return 1;
+}
+
+static int regexPrecompiled(regex_t *regex, const char *line, struct aesd_seekto *pSeekObj) {
+    regmatch_t groups[3];
+    if (regexec(regex, line, 3, groups, 0) == REG_NOMATCH) return 0;
+    pSeekObj->write_cmd = (uint32_t)strtoul(&line[groups[1].rm_so], NULL, 10);
+    pSeekObj->write_cmd_offset = (uint32_t)strtoul(&line[groups[2].rm_so], NULL, 10);
+    return 1;
+}
+
+static double elapsedns(struct timespec *t0, struct timespec *t1) {
+    return (t1->tv_sec - t0->tv_sec) * 1e9 + (t1->tv_nsec - t0->tv_nsec);
+}
+
+int main(int argc, char *argv[]) {
+    long nlines = argc > 1 ? strtol(argv[1], NULL, 10) : 1000000;
+    long pctcmd = argc > 2 ? strtol(argv[2], NULL, 10) : 10;
+
+    // Mixed corpus of plain data lines and seekto control lines
+    static char lines[NSAMPLES][64];
+    static size_t lens[NSAMPLES];
+    srand(1);
+    for (int i = 0; i < NSAMPLES; i++) {
+        if (rand() % 100 < pctcmd)
+            snprintf(lines[i], sizeof(lines[i]), "AESDCHAR_IOCSEEKTO:%d,%d\n", rand() % 10, rand() % 64);
+        else snprintf(lines[i], sizeof(lines[i]), "data line %d with some payload text\n", rand());
+        lens[i] = strlen(lines[i]);
+    }
+
+    struct timespec t0, t1;
+    struct aesd_seekto so;
+    regex_t regex;
+    Command cmd;
+    long hits;
+
+    regcomp(&regex, "^AESDCHAR_IOCSEEKTO:([0-9]+),([0-9]+)", REG_EXTENDED);
+
+    // Regex per line is orders of magnitude slower; run a tenth of lines
+    long nregex = nlines / 10 > 0 ? nlines / 10 : 1;
+    hits = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (long i = 0; i < nregex; i++) hits += regexPerLine(lines[i % NSAMPLES], &so);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("regcomp per line : %8.1f ns/line (%ld lines, %ld cmds)\n", elapsedns(&t0, &t1) / nregex, nregex, hits);
+
+    hits = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (long i = 0; i < nlines; i++) hits += regexPrecompiled(&regex, lines[i % NSAMPLES], &so);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("regex precompiled: %8.1f ns/line (%ld lines, %ld cmds)\n", elapsedns(&t0, &t1) / nlines, nlines, hits);
+
+    hits = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (long i = 0; i < nlines; i++)
+        hits += parseCommand(lines[i % NSAMPLES], lens[i % NSAMPLES], &cmd) == CMD_SEEKTO;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("parseCommand     : %8.1f ns/line (%ld lines, %ld cmds)\n", elapsedns(&t0, &t1) / nlines, nlines, hits);
+
+    regfree(&regex);
+    return 0;
+}
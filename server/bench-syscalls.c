@@ -0,0 +1,109 @@
+/*
+    Syscall counter for comparing engines: runs a command (the server)
+    under ptrace(2), following every thread it clones, and counts the
+    syscalls they enter between SIGUSR1 (start of the window) and
+    SIGUSR2 (end), so startup and teardown are left out. The count is
+    printed when the window closes; SIGTERM and SIGINT are forwarded to
+    the command, and the counter exits with it. Tracing slows every
+    syscall down, so measure latency in a separate, untraced run.
+
+    usage: bench-syscalls command [args...]
+*/
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static volatile sig_atomic_t windowOpen = 0, windowClosed = 0, stopRequested = 0;
+
+static void onSignal(int sig) {
+    if (sig == SIGUSR1) windowOpen = 1;
+    else if (sig == SIGUSR2) windowClosed = 1;
+    else stopRequested = 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("usage: bench-syscalls command [args...]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pid_t child = fork();
+    if (child == -1) {
+        perror("bench-syscalls: fork");
+        exit(EXIT_FAILURE);
+    }
+    if (child == 0) {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        execv(argv[1], argv + 1);
+        perror("bench-syscalls: execv");
+        _exit(127);
+    }
+
+    int st;
+    waitpid(child, &st, 0);
+    long opts = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL;
+    if (ptrace(PTRACE_SETOPTIONS, child, NULL, opts) == -1) {
+        perror("bench-syscalls: ptrace");
+        kill(child, SIGKILL);
+        exit(EXIT_FAILURE);
+    }
+
+    // No SA_RESTART, so a signal breaks waitpid(2) and is seen promptly
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onSignal;
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    ptrace(PTRACE_SYSCALL, child, NULL, NULL);
+
+    unsigned long nsyscalls = 0;
+    int counting = 0, exitcode = EXIT_FAILURE;
+    while (1) {
+        if (windowOpen) {
+            windowOpen = 0;
+            nsyscalls = 0;
+            counting = 1;
+        }
+        if (windowClosed) {
+            windowClosed = 0;
+            counting = 0;
+            printf("syscalls: %lu\n", nsyscalls);
+            fflush(stdout);
+        }
+        if (stopRequested) {
+            stopRequested = 0;
+            kill(child, SIGTERM);
+        }
+
+        pid_t tid = waitpid(-1, &st, __WALL);
+        if (tid == -1) {
+            if (errno == EINTR) continue;
+            break; // ECHILD, every thread is gone
+        }
+        if (WIFEXITED(st) || WIFSIGNALED(st)) {
+            if (tid == child) exitcode = WIFEXITED(st) ? WEXITSTATUS(st) : EXIT_FAILURE;
+            continue;
+        }
+
+        // Syscall stops come in entry/exit pairs; only entries are counted,
+        // so a thread blocked when the window opens is not half counted
+        int sig = WSTOPSIG(st), deliver = 0;
+        if (sig == (SIGTRAP | 0x80)) {
+            struct __ptrace_syscall_info info;
+            if (counting && ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(info), &info) > 0 &&
+                info.op == PTRACE_SYSCALL_INFO_ENTRY) nsyscalls += 1;
+        }
+        else if (sig != SIGTRAP && sig != SIGSTOP) deliver = sig; // Not a clone or attach stop
+        ptrace(PTRACE_SYSCALL, tid, NULL, deliver);
+    }
+    return exitcode;
+}
@@ -0,0 +1,121 @@
+/*
+    Microbenchmark of sealed segment compression (-Z): packBlocks() and
+    unpackBlock() at several zlib levels versus the raw path (pwrite the
+    segment, pread it back), on a synthetic corpus of repetitive client
+    lines interleaved with "timestamp:" lines every tsevery lines. Files
+    live in memory (memfd), so the times are CPU cost alone.
+
+    usage: bench-zblock [segment MiB] [tsevery]
+*/
+#define _GNU_SOURCE // memfd_create(2)
+#include "zblock.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *words[] = {
+    "sensor", "temp", "ok", "reading", "node", "edge", "alpha", "status", "42", "ack",
+};
+
+static double elapsedns(struct timespec *t0, struct timespec *t1) {
+    return (t1->tv_sec - t0->tv_sec) * 1e9 + (t1->tv_nsec - t0->tv_nsec);
+}
+
+// Fills buf with n bytes of newline-terminated lines, as a long-running
+// server would store them (timestamps 10 s apart)
+static void makeCorpus(char *buf, size_t n, long tsevery) {
+    time_t t = 1700000000;
+    size_t off = 0;
+    char line[256];
+
+    srand(1);
+    for (long i = 0; off < n; i++) {
+        int len = 0;
+        if (tsevery > 0 && i % tsevery == tsevery - 1) {
+            struct tm tm;
+            gmtime_r(&t, &tm);
+            t += 10;
+            len = strftime(line, sizeof(line), "timestamp:%a, %d %b %Y %T +0000\n", &tm);
+        }
+        else {
+            len = snprintf(line, sizeof(line), "%s-%ld", words[rand() % 10], i % 1000);
+            for (int w = rand() % 6; w > 0; w--) len += snprintf(line + len, sizeof(line) - len, " %s", words[rand() % 10]);
+            line[len++] = '\n';
+        }
+        size_t take = (size_t)len < n - off ? (size_t)len : n - off;
+        memcpy(buf + off, line, take);
+        off += take;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    size_t n = (argc > 1 ? strtoul(argv[1], NULL, 10) : 16) << 20;
+    long tsevery = argc > 2 ? strtol(argv[2], NULL, 10) : 20;
+    static const int levels[] = { 1, 3, 6, 9 };
+    struct timespec t0, t1;
+
+    char *data = (char *)malloc(n), *back = (char *)malloc(n);
+    if (data == NULL || back == NULL || n == 0) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    makeCorpus(data, n, tsevery);
+    printf("corpus %zu bytes, a timestamp every %ld lines, %zu byte blocks\n", n, tsevery, ZBLOCK);
+    printf("%-6s %10s %7s %12s %12s %14s\n", "level", "stored", "ratio", "write MB/s", "read MB/s", "read 4K ns/op");
+
+    // Raw path: what an uncompressed sealed segment costs to write and read back
+    int fd = memfd_create("raw", 0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (pwrite(fd, data, n, 0) != (ssize_t)n) perror("pwrite");
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double wns = elapsedns(&t0, &t1);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (pread(fd, back, n, 0) != (ssize_t)n) perror("pread");
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double rns = elapsedns(&t0, &t1);
+    printf("%-6s %10zu %7.2f %12.0f %12.0f %14.0f\n", "raw", n, 1.0, n / wns * 1e3, n / rns * 1e3,
+        rns / (n / 4096.0));
+    close(fd);
+
+    for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+        ZIndex zi;
+        fd = memfd_create("packed", 0);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (packBlocks(fd, data, n, levels[l], &zi) == -1) return EXIT_FAILURE;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        wns = elapsedns(&t0, &t1);
+
+        // Sequential read back, one inflate per block
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (size_t b = 0; b < zi.nblocks; b++) {
+            if (unpackBlock(fd, &zi, b, back + b * ZBLOCK) == -1) return EXIT_FAILURE;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        rns = elapsedns(&t0, &t1);
+        if (memcmp(data, back, n) != 0) {
+            fprintf(stderr, "level %i: content differs\n", levels[l]);
+            return EXIT_FAILURE;
+        }
+
+        // Uncached random 4K reads inflate a whole block each
+        char *blk = (char *)malloc(ZBLOCK);
+        long nops = 256;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (long i = 0; i < nops; i++) unpackBlock(fd, &zi, rand() % zi.nblocks, blk);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        free(blk);
+
+        printf("%-6i %10ld %7.2f %12.0f %12.0f %14.0f\n", levels[l], (long)zi.packed, (double)n / zi.packed,
+            n / wns * 1e3, n / rns * 1e3, elapsedns(&t0, &t1) / nops);
+        freeZIndex(&zi);
+        close(fd);
+    }
+
+    free(data);
+    free(back);
+    return EXIT_SUCCESS;
+}
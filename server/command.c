@@ -0,0 +1,63 @@
+#include "command.h"
+
+#include <string.h>
+
+#define VERB(v) v, sizeof(v) - 1
+
+
+// Parses one or more decimal digits at *p into *out, advancing *p.
+// Returns -1 if there are no digits or the value overflows uint32_t.
+static int parseUint32(const char **p, const char *end, uint32_t *out) {
+    const char *s = *p;
+    uint64_t v = 0;
+
+    while (s < end && *s >= '0' && *s <= '9') {
+        v = v * 10 + (uint64_t)(*s - '0');
+        if (v > UINT32_MAX) return -1;
+        s++;
+    }
+
+    if (s == *p) return -1;
+    *out = (uint32_t)v;
+    *p = s;
+    return 0;
+}
+
+// X,Y for AESDCHAR_IOCSEEKTO:X,Y (trailing bytes, e.g. '\n', ignored)
+static int parseSeekTo(const char *args, size_t n, Command *cmd) {
+    const char *p = args, *end = args + n;
+
+    if (parseUint32(&p, end, &cmd->arg.seekto.write_cmd) == -1) return -1;
+    else if (p == end || *p++ != ',') return -1;
+    else if (parseUint32(&p, end, &cmd->arg.seekto.write_cmd_offset) == -1) return -1;
+    return 0;
+}
+
+// Argument-less verbs: only a line ending may follow
+static int parseNoArgs(const char *args, size_t n, Command *cmd) {
+    (void)cmd;
+    if (n > 0 && args[0] == '\r') args++, n--;
+    return n == 0 || (n == 1 && args[0] == '\n') ? 0 : -1;
+}
+
+static const CommandSpec commandTable[] = {
+    { VERB("AESDCHAR_IOCSEEKTO:"), CMD_SEEKTO, parseSeekTo },
+    { VERB("AESDSOCKET_STATS"), CMD_STATS, parseNoArgs },
+    { VERB("AESDSOCKET_DELTA"), CMD_DELTA, parseNoArgs },
+};
+
+// Single pass over line: plain data lines are rejected on length or
+// first byte for every verb, so they cost a few comparisons only
+CommandId parseCommand(const char *line, size_t n, Command *cmd) {
+    cmd->id = CMD_NONE;
+
+    for (size_t i = 0; i < sizeof(commandTable) / sizeof(commandTable[0]); i++) {
+        const CommandSpec *spec = &commandTable[i];
+        if (n < spec->len || line[0] != spec->verb[0]) continue;
+        else if (memcmp(line, spec->verb, spec->len) != 0) continue;
+
+        if (spec->parse(&line[spec->len], n - spec->len, cmd) == 0) cmd->id = spec->id;
+        return cmd->id;
+    }
+    return CMD_NONE;
+}
@@ -0,0 +1,41 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+#include <stddef.h>
+
+/*
+    Control line recognized by parseCommand(). CMD_NONE means a
+    plain data line to be appended to BACKEND.
+*/
+typedef enum {
+    CMD_NONE = 0,
+    CMD_SEEKTO,      // AESDCHAR_IOCSEEKTO:X,Y
+    CMD_STATS,       // AESDSOCKET_STATS (metrics report, see metrics.h)
+    CMD_DELTA,       // AESDSOCKET_DELTA (delta responses, see connthread.h)
+} CommandId;
+
+typedef struct {
+    CommandId id;
+    union {
+        struct aesd_seekto seekto;
+    } arg;
+} Command;
+
+/*
+    Dispatch table entry: control lines start with verb (including
+    any ':' separator) and the remaining bytes are handed to parse,
+    which fills cmd->arg and returns 0, or -1 if malformed (the line
+    is then treated as plain data). Add new control verbs here.
+*/
+typedef struct {
+    const char *verb;
+    size_t len;
+    CommandId id;
+    int (*parse)(const char *args, size_t n, Command *cmd);
+} CommandSpec;
+
+CommandId parseCommand(const char *line, size_t n, Command *cmd);
+
+#endif /* COMMAND_H */
@@ -1,42 +1,72 @@
+#define _GNU_SOURCE // splice(2), pipe2(2)
+
 #include "connthread.h"
+#include "durable.h"
+#include "logger.h"
+#include "metrics.h"
+#include "registry.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <regex.h>
 #include <string.h>
-#include <sys/ioctl.h>
-#include <syslog.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
 
 #define BLKINIT 512
-
-static pthread_mutex_t backendLock = PTHREAD_MUTEX_INITIALIZER;
+#define SENDCHUNK (1 << 20)
+#define CONNARENA 16    // ConnThreads carved per arena
+
+// BACKEND is opened once (store) and shared by all connections using
+// positional I/O only. Appends atomically reserve [off, off+n) from
+// backendTail and write it through the store outside any lock. appendLock
+// then covers only publishing, in reservation order: History append and
+// advancing backendEnd. Readers never lock: they read/sendfile from their
+// own cursor up to the backendEnd (or History size) they observed, so a
+// slow client can no longer stall every other connection.
+static pthread_mutex_t appendLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t publishCond = PTHREAD_COND_INITIALIZER;
+static _Atomic off_t backendTail = 0;
+static _Atomic off_t backendEnd = 0;
+static Backend *store = NULL;
+static History *history = NULL; // BACKEND mirror, NULL if not mirrored
+static SeekIndex *seekIndex = NULL; // Write-command index, NULL to scan
+static int batching = 0;        // Coalesce buffered data lines (-b)
+static Slab connSlab;           // Recycled ConnThread structs
+static pthread_once_t connSlabOnce = PTHREAD_ONCE_INIT;
 
 
 LineBuffer newLineBuffer() {
     LineBuffer lb;
     lb.index = 0;
     lb.buffersz = BLKINIT;
-    lb.data = (char *)malloc(BLKINIT);
+    lb.data = (char *)allocBlock(&lb.buffersz);
     if (lb.data == NULL)
-        syslog(LOG_ERR, "ERROR in newLineBuffer::malloc(3): %m");
+        logMsg(LOG_ERR, "ERROR in newLineBuffer::allocBlock: %m");
     
     return lb;
 }
 
+// Moves content to a pooled block of at least dsize bytes
+static int growLineBuffer(LineBuffer *self, size_t dsize) {
+    char *dbuffer = (char *)allocBlock(&dsize);
+    if (dbuffer == NULL) {
+        logMsg(LOG_ERR, "ERROR in growLineBuffer::allocBlock: %m");
+        return -1;
+    }
+
+    memcpy(dbuffer, self->data, self->index + 1);
+    freeBlock(self->data, self->buffersz);
+    self->data = dbuffer;
+    self->buffersz = dsize;
+
+    logMsg(LOG_DEBUG, "Grew LineBuffer to %li bytes", self->buffersz);
+    return 0;
+}
+
 int append(LineBuffer *self, char ch) {
     if ((self->index + 1) == self->buffersz) {
-        size_t dsize = self->buffersz * 2;
-        void *dbuffer = realloc((void *)self->data, dsize);
-        if (dbuffer == NULL) {
-            syslog(LOG_ERR, "ERROR in append::realloc(3): %m");
-            return -1;
-        }
-        self->data = (char *)dbuffer;
-        self->buffersz = dsize;
-
-        syslog(LOG_DEBUG, "Realloc'd LineBuffer to %li bytes", self->buffersz);
+        if (growLineBuffer(self, self->buffersz * 2) == -1) return -1;
     }
 
     self->data[self->index] = ch;
@@ -45,249 +75,685 @@ int append(LineBuffer *self, char ch) {
     return 0;
 }
 
+int appendBytes(LineBuffer *self, const char *bytes, size_t n) {
+    if ((self->index + n + 1) > self->buffersz) {
+        size_t dsize = self->buffersz * 2;
+        while ((self->index + n + 1) > dsize) dsize *= 2;
+        if (growLineBuffer(self, dsize) == -1) return -1;
+    }
+
+    memcpy(&self->data[self->index], bytes, n);
+    self->data[self->index + n] = '\0';
+    self->index += n;
+    return 0;
+}
+
 void reset(LineBuffer *self) {
     self->index = 0;
 }
 
 void destroy(LineBuffer *self) {
+    if (self->data) freeBlock((void *)self->data, self->buffersz);
     self->index = 0;
     self->buffersz = 0;
-    if (self->data) free((void *)self->data);
     self->data = NULL;
 }
 
+void resetRecvBuffer(RecvBuffer *self) {
+    self->head = self->tail = 0;
+}
+
+// Single recv(2) of up to RECVBUFSZ bytes into a drained buffer.
+// Returns bytes received, 0 on EOF or -1 on ERROR (errno preserved).
+ssize_t fillRecvBuffer(RecvBuffer *self, int cfd) {
+    ssize_t numRead = recv(cfd, self->data, RECVBUFSZ, 0);
+    self->head = 0;
+    self->tail = numRead > 0 ? numRead : 0;
+    return numRead;
+}
+
+// Moves buffered bytes into line up to and including the first '\n'.
+// Returns 1 if line is complete, 0 if more input is needed, -1 on ERROR.
+int takeLine(RecvBuffer *self, LineBuffer *line) {
+    if (self->head == self->tail) return 0;
+
+    char *start = &self->data[self->head];
+    char *eol = memchr(start, '\n', self->tail - self->head);
+    size_t n = eol ? (size_t)(eol - start) + 1 : self->tail - self->head;
+
+    if (appendBytes(line, start, n) == -1) return -1;
+    self->head += n;
+    if (eol) countMetric(M_LINES, 1);
+    return eol != NULL;
+}
+
+// Appends the next buffered line to line only if it is complete and
+// plain data. Returns 1 if appended, 0 if not (incomplete or command).
+int takeDataLine(RecvBuffer *self, LineBuffer *line) {
+    if (self->head == self->tail) return 0;
+
+    char *start = &self->data[self->head];
+    char *eol = memchr(start, '\n', self->tail - self->head);
+    if (eol == NULL) return 0;
+
+    Command cmd;
+    size_t n = (size_t)(eol - start) + 1;
+    if (parseCommand(start, n, &cmd) != CMD_NONE) return 0;
+    else if (appendBytes(line, start, n) == -1) return 0;
+
+    self->head += n;
+    countMetric(M_LINES, 1);
+    return 1;
+}
+
+static void initConnSlab() {
+    initSlab(&connSlab, "ConnThread", sizeof(ConnThread), CONNARENA, 0);
+}
+
+// Clears per-connection state, for a ConnThread reused by the next client
+void resetConnThread(ConnThread *self) {
+    self->rpos = 0;
+    self->wend = 0;
+    self->delta = 0;
+    self->cursor = 0;
+    resetRecvBuffer(&self->rx);
+}
+
 ConnThread *newConnThread(const char *backend) {
-    static unsigned int _tid_generator = 1;
+    static atomic_uint _tid_generator = 1; // Shared by epoll shards
 
-    ConnThread *ct = (ConnThread *)malloc(sizeof(ConnThread));
+    pthread_once(&connSlabOnce, initConnSlab);
+    ConnThread *ct = (ConnThread *)slabAlloc(&connSlab);
     if (ct == NULL) {
-        syslog(LOG_ERR, "ERROR in newConnThread::malloc(3): %m");
+        logMsg(LOG_ERR, "ERROR in newConnThread::slabAlloc: %m");
         return NULL;
     }
 
     ct->cfd = -1;
-    ct->fd = -1;
+    ct->fd = store ? store->fd : -1;
     ct->backend = backend;
-    ct->tid = _tid_generator++;
+    ct->tid = atomic_fetch_add(&_tid_generator, 1);
+    resetConnThread(ct);
     ct->_exitflag = 0;
     ct->_doneFlag = 0;
-    ct->next = NULL;
+    ct->registry = NULL;
+    ct->prev = ct->next = ct->doneNext = NULL;
     return ct;
 }
 
+void freeConnThread(ConnThread *self) {
+    slabFree(&connSlab, self);
+}
+
+void logPoolStats() {
+    pthread_once(&connSlabOnce, initConnSlab);
+    logSlabStats(&connSlab);
+    logBlockStats();
+}
+
+void destroyPools() {
+    pthread_once(&connSlabOnce, initConnSlab);
+    destroySlab(&connSlab);
+    destroyBlocks();
+}
+
 ssize_t readLine(ConnThread *self, LineBuffer *line) {
-    char ch;
+    int rc;
     reset(line);
 
-    while (1) {
-        ssize_t numRead = read(self->cfd, &ch, 1);
+    while ((rc = takeLine(&self->rx, line)) == 0) {
+        ssize_t numRead = fillRecvBuffer(&self->rx, self->cfd);
         if (numRead == -1) {
             if (errno == EINTR) continue; // If just inturrupted, try again
-            syslog(LOG_ERR, "ERROR in readLine::read(%i): %m", self->cfd);
+            logMsg(LOG_ERR, "ERROR in readLine::recv(%i): %m", self->cfd);
             return -1;
         }
         else if (numRead == 0) break; // EOF
-        else if (append(line, ch) == -1) return -1; // Append ch 
-        else if (ch == '\n') break; // EOL
     }
+    if (rc == -1) return -1; // Append ERROR
 
-    syslog(LOG_DEBUG, "[TID: %i] Read %li bytes", self->tid, line->index);
+    logMsg(LOG_DEBUG, "[TID: %i] Read %li bytes", self->tid, line->index);
     return line->index;
 }
 
+// Resolves SEEKTO through index from now on. Returns -1 if index is NULL.
+int attachSeekIndex(SeekIndex *index) {
+    seekIndex = index;
+    return index ? 0 : -1;
+}
+
+void attachHistory(History *hist) {
+    history = hist;
+}
+
+void enableBatching(int on) {
+    batching = on;
+}
+
+// In batching mode, extends a plain data line with every further data
+// line already buffered in self->rx (stopping at a command or partial
+// line), so they commit with one append and get one coalesced response
+// reflecting the final state. Returns number of lines added.
+int gatherBatch(ConnThread *self, LineBuffer *line) {
+    Command cmd;
+    int nlines = 0;
+
+    if (!batching || parseCommand(line->data, line->index, &cmd) != CMD_NONE) return 0;
+    while (takeDataLine(&self->rx, line)) nlines += 1;
+
+    if (nlines) logMsg(LOG_DEBUG, "[TID: %i] Batched %i more lines (%zu bytes)", self->tid, nlines, line->index);
+    return nlines;
+}
+
+int snapshotBackend(HistSnapshot *snap) {
+    return history ? takeSnapshot(history, snap) : -1;
+}
+
+// Shares an open Backend with every connection and publishes its size
+// as initial end offset (unordered stores report their own end)
+int attachBackend(Backend *backend) {
+    store = backend;
+    if (store && store->ordered) {
+        off_t size = store->ops->size(store);
+        if (size == -1) {
+            logMsg(LOG_ERR, "ERROR in attachBackend::size(%s): %m", store->path);
+            return -1;
+        }
+        atomic_store(&backendTail, size);
+        atomic_store(&backendEnd, size);
+    }
+    return 0;
+}
+
+BackendKind backendKind() {
+    return store->kind;
+}
+
+int backendFileno() {
+    return store->fd;
+}
+
+// Offset of the oldest content BACKEND retains (0 unless segmented)
+off_t backendBase() {
+    return atomic_load(&store->base);
+}
+
+// BACKEND content at off straight from its mapping, *n bytes below end,
+// or NULL where it is not mapped. Pass pin to releaseView() when done.
+const char *viewBackend(off_t off, off_t end, size_t *n, void **pin) {
+    return store->ops->view(store, off, end, n, pin);
+}
+
+void releaseView(void *pin) {
+    store->ops->release(store, pin);
+}
+
+// Keeps retention from dropping BACKEND content from off (raised to the
+// window if it fell below) until unholdBackend(token), for one response
+off_t holdBackend(off_t off, long *token) {
+    return store->ops->hold(store, off, token);
+}
+
+void unholdBackend(long token) {
+    store->ops->unhold(store, token);
+}
+
+ssize_t readBackend(char *buf, size_t n, off_t off) {
+    return store->ops->read(store, buf, n, off);
+}
+
+ssize_t appendBackend(const char *data, size_t n, off_t off) {
+    return store->ops->append(store, data, n, off);
+}
+
+// End offset of BACKEND as of the last published append for an ordered
+// store (file, mem), or as reported by the driver for a char device
+off_t observeBackendEnd() {
+    if (store->ordered) return atomic_load(&backendEnd);
+
+    off_t end = store->ops->size(store);
+    if (end == -1) logMsg(LOG_ERR, "ERROR in observeBackendEnd::size(%s): %m", store->path);
+    return end;
+}
+
+// Reserves [off, off+n) at the end of BACKEND for one append
+off_t reserveAppend(size_t n) {
+    return atomic_fetch_add(&backendTail, n);
+}
+
+// Publishes a reserved append once every earlier reservation is published:
+// History append (or cold mirror if the write failed) and new end offset.
+// Callers that complete appends asynchronously must publish in offset
+// order themselves, or this would wait on their own earlier append.
+int publishAppend(const char *data, off_t off, size_t n, int ok) {
+    if (lockAppend() != 0) return -1;
+    while (store->ordered && atomic_load(&backendEnd) != off)
+        pthread_cond_wait(&publishCond, &appendLock);
+
+    if (history && !ok) markHistoryCold(history);
+    else if (history) appendHistory(history, data, n);
+    if (seekIndex && ok) indexAppend(seekIndex, data, n, off);
+    atomic_store(&backendEnd, off + n);
+    pthread_cond_broadcast(&publishCond);
+
+    if (ok) countMetric(M_APPENDED, n);
+    if (unlockAppend() != 0) return -1;
+
+    // Retention drops whole segments outside appendLock
+    store->ops->trim(store, off + n);
+    return 0;
+}
+
+// Commits one append: reserve offset, write it through the store without
+// lock, then publish in reservation order under appendLock (History append
+// + new end offset). A failed write still publishes its range so later
+// appends never stall. Sets *end to the end offset of the append.
+static ssize_t commitAppend(const char *data, size_t n, off_t *end) {
+    off_t off = reserveAppend(n);
+    *end = off + n;
+    ssize_t numWrite = appendBackend(data, n, off);
+    int werrno = errno;
+
+    if (publishAppend(data, off, n, numWrite != -1) != 0) return -1;
+    errno = werrno;
+    return numWrite;
+}
+
 ssize_t writeFile(ConnThread *self, LineBuffer *line) {
-    ssize_t numWrite = write(self->fd, line->data, line->index);
-    if (numWrite == -1) syslog(LOG_ERR, "ERROR in writeFile::write(2): %m");
-    else syslog(LOG_DEBUG, "[TID: %i] Wrote %li (of %li) bytes to %s", 
+    uint64_t t0 = metricsClock();
+    ssize_t numWrite = commitAppend(line->data, line->index, &self->wend);
+    recordLatency(H_WRITE, metricsClock() - t0);
+    if (numWrite != -1 && durableEnabled()) requestDurable(self->wend);
+    if (numWrite == -1) logMsg(LOG_ERR, "ERROR in writeFile::append(%s): %m", self->backend);
+    else logMsg(LOG_DEBUG, "[TID: %i] Wrote %li (of %li) bytes to %s", 
         self->tid, numWrite, line->index, self->backend);
 
     return numWrite;
 }
 
-ssize_t writeTimestamp(const char *backend) {    
-    static char timestamp[64];
-
+// Formats the current local time as a "timestamp:..." line into buf.
+// Returns the line length, or -1 on ERROR.
+ssize_t formatTimestamp(char *buf, size_t bufsz) {
     struct tm *lt;
     time_t t = time(NULL);
     if ((lt = localtime(&t)) == NULL) {
-        syslog(LOG_ERR, "ERROR in writeTimestamp::localtime(2): %m");
+        logMsg(LOG_ERR, "ERROR in formatTimestamp::localtime(2): %m");
         return -1;
     }
-    else if (strftime(timestamp, sizeof(timestamp), "timestamp:%a, %d %b %Y %T %z\n", lt) == 0) {
-        syslog(LOG_ERR, "ERROR in writeTimestamp::strftime: returned 0");
+    else if (strftime(buf, bufsz, "timestamp:%a, %d %b %Y %T %z\n", lt) == 0) {
+        logMsg(LOG_ERR, "ERROR in formatTimestamp::strftime: returned 0");
         return -1;
     }
+    return strlen(buf);
+}
 
-    int err, fd = -1;
-    if ((fd = open(backend, O_CREAT|O_WRONLY|O_APPEND, 0644)) == -1) { 
-        syslog(LOG_ERR, "ERROR in writeTimestamp::open(%s) %m", backend);
-        return -1;
-    }
+ssize_t writeTimestamp(const char *backend) {    
+    static char timestamp[64];
 
-    // Obtain BACKEND lock
-    if ((err = pthread_mutex_lock(&backendLock)) != 0) {
-        syslog(LOG_ERR, "ERROR in writeTimestamp::pthread_mutex_lock(3p): %s", strerror(err));
-        close(fd);
-        return -1;
-    }
+    ssize_t slen = formatTimestamp(timestamp, sizeof(timestamp));
+    if (slen == -1) return -1;
 
-    size_t slen = strlen(timestamp);
-    ssize_t numWrite = write(fd, timestamp, slen);
-    if (numWrite == -1) syslog(LOG_ERR, "ERROR in writeTimestamp::write(2): %m");
-    else syslog(LOG_DEBUG, "Wrote \'%s\' (%li of %li bytes) to %s", timestamp, numWrite, slen, backend);
-    
-    // Release BACKEND lock
-    if ((err = pthread_mutex_unlock(&backendLock)) != 0) {
-        syslog(LOG_ERR, "ERROR in writeTimestamp::pthread_mutex_unlock(3p): %s", strerror(err));
-        close(fd);
-        return -1;
-    }
+    off_t end;
+    ssize_t numWrite = commitAppend(timestamp, slen, &end);
+    if (numWrite == -1) logMsg(LOG_ERR, "ERROR in writeTimestamp::append(%s): %m", backend);
+    else logMsg(LOG_DEBUG, "Wrote \'%s\' (%li of %li bytes) to %s", timestamp, numWrite, slen, backend);
 
-    close(fd);
     return numWrite;
 }
 
-ssize_t sendFile(ConnThread *self, int whence) {
+// Copies backend range [self->rpos, end) to client through a user space
+// block. Fallback path when the kernel refuses sendfile(2)/splice(2) for
+// backend, or where it is not mapped. Stops at end, as a store may hold
+// appends past it that are not published yet.
+static int copyBackend(ConnThread *self, off_t end, ssize_t *totalSent, ssize_t *npackets) {
     static size_t blkx8 = BLKINIT*8;
     
     ssize_t numRead, numWrit;
-    ssize_t totalSent = 0;
-    ssize_t npackets = 0;
     char block[blkx8];
 
-    // Offset always 0, really just to enable seek to beginning of backend
-    // (for send after write) or to leave at SET_CUR (for send after ioctl)
-    if (lseek(self->fd, 0, whence) == -1) {
-        syslog(LOG_ERR, "ERROR in sendFile::lseek(%i): %m", self->fd);
-        return -1;
-    }
-
-    while (1) {
-        // Read blkx8 bytes from file
-        if ((numRead = read(self->fd, (void *)block, blkx8)) == -1) {
-            if (errno == EINTR) continue; // Just inturrupted
-            syslog(LOG_ERR, "ERROR in sendFile::read(%i): %m", self->fd);
-            break;
+    while (self->rpos < end) {
+        size_t want = (end - self->rpos) < (off_t)blkx8 ? (size_t)(end - self->rpos) : blkx8;
+        // Read up to blkx8 bytes from file
+        if ((numRead = readBackend(block, want, self->rpos)) == -1) {
+            logMsg(LOG_ERR, "ERROR in copyBackend::read(%s): %m", self->backend);
+            return -1;
         }
-        
+
         if (numRead == 0) // EOF
-            break; 
+            return 0; 
 
         // Send numRead bytes to client
         numWrit = write(self->cfd, (void *)block, numRead);
-        totalSent += numWrit;
-        npackets += 1;
+        self->rpos += numRead;
+        *totalSent += numWrit;
+        *npackets += 1;
 
         if (numWrit != numRead) {
-            syslog(LOG_ERR, "ERROR in sendFile::write(%i): %m", self->cfd);
+            logMsg(LOG_ERR, "ERROR in copyBackend::write(%i): %m", self->cfd);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Zero-copy send of regular file backend range [self->rpos, end).
+// Returns 0 on EOF, -1 on ERROR or 1 if unsupported (nothing sent).
+static int sendfileBackend(ConnThread *self, off_t end, ssize_t *totalSent, ssize_t *npackets) {
+    ssize_t numSent;
+
+    while (self->rpos < end) {
+        size_t count = (end - self->rpos) < SENDCHUNK ? (size_t)(end - self->rpos) : SENDCHUNK;
+        if ((numSent = sendfile(self->cfd, self->fd, &self->rpos, count)) == -1) {
+            if (errno == EINTR) continue; // Just inturrupted
+            else if ((errno == EINVAL || errno == ENOSYS) && *npackets == 0) return 1;
+            logMsg(LOG_ERR, "ERROR in sendfileBackend::sendfile(%i): %m", self->cfd);
+            return -1;
+        }
+        else if (numSent == 0) return 0; // EOF
+
+        *totalSent += numSent;
+        *npackets += 1;
+    }
+    return 0;
+}
+
+// Zero-copy send of char device backend from self->rpos through a pipe,
+// as sendfile(2) requires a mmap-able source. Returns 0 on EOF, -1 on ERROR or 1 if
+// the driver does not support splice_read. Pipe is always drained
+// before the next splice from backend, so fallback never loses data.
+static int spliceBackend(ConnThread *self, ssize_t *totalSent, ssize_t *npackets) {
+    ssize_t numIn, numOut;
+    int pfd[2], status = 0;
+
+    if (pipe2(pfd, O_CLOEXEC) == -1) {
+        logMsg(LOG_ERR, "ERROR in spliceBackend::pipe2(2): %m");
+        return 1;
+    }
+
+    while (1) {
+        if ((numIn = splice(self->fd, &self->rpos, pfd[1], NULL, SENDCHUNK, SPLICE_F_MOVE)) == -1) {
+            if (errno == EINTR) continue; // Just inturrupted
+            else if (errno == EINVAL || errno == ENOSYS) status = 1;
+            else {
+                logMsg(LOG_ERR, "ERROR in spliceBackend::splice(%i): %m", self->fd);
+                status = -1;
+            }
             break;
         }
+        else if (numIn == 0) break; // EOF
+
+        // Drain pipe to client
+        while (numIn > 0) {
+            if ((numOut = splice(pfd[0], NULL, self->cfd, NULL, numIn, SPLICE_F_MOVE)) == -1) {
+                if (errno == EINTR) continue;
+                logMsg(LOG_ERR, "ERROR in spliceBackend::splice(%i): %m", self->cfd);
+                status = -1;
+                break;
+            }
+            numIn -= numOut;
+            *totalSent += numOut;
+        }
+        *npackets += 1;
+        if (status) break;
+    }
+
+    close(pfd[0]);
+    close(pfd[1]);
+    return status;
+}
+
+// Sends range [self->rpos, end) straight from the BACKEND mapping (mem
+// store, file or segments). Returns 0 when done, -1 on ERROR or 1 if
+// part of it is not mapped (the rest is left to the copy path).
+static int sendMemory(ConnThread *self, off_t end, ssize_t *totalSent, ssize_t *npackets) {
+    ssize_t numSent;
+    size_t count;
+    void *pin;
+
+    while (self->rpos < end) {
+        const char *mem = viewBackend(self->rpos, end, &count, &pin);
+        if (mem == NULL) return 1;
+
+        if (count > SENDCHUNK) count = SENDCHUNK;
+        numSent = send(self->cfd, mem, count, MSG_NOSIGNAL);
+        releaseView(pin);
+        if (numSent == -1) {
+            if (errno == EINTR) continue; // Just inturrupted
+            logMsg(LOG_ERR, "ERROR in sendMemory::send(%i): %m", self->cfd);
+            return -1;
+        }
+        self->rpos += numSent;
+        *totalSent += numSent;
+        *npackets += 1;
+    }
+    return 0;
+}
+
+ssize_t sendFile(ConnThread *self, int whence) {
+    ssize_t totalSent = 0;
+    ssize_t npackets = 0;
+    int rc;
+
+    // Read cursor is per connection: from beginning of backend (for send
+    // after write) or left where sendIoctl() put it (for send after ioctl).
+    // End first, then hold the start so retention keeps all in between.
+    if (whence == SEEK_SET) self->rpos = backendBase();
+    off_t end = observeBackendEnd();
+    long hold;
+    self->rpos = holdBackend(self->rpos, &hold);
+
+    // Regular file => sendfile(2) up to observed end, char device =>
+    // splice(2) (driver serializes its own reads), mem store or segments
+    // (no single fd) => send(2) from the mapping, else copy
+    switch (backendKind()) {
+    case BACKEND_FILE:
+        if (self->fd != -1 && (rc = sendfileBackend(self, end, &totalSent, &npackets)) != 1) break;
+        rc = sendMemory(self, end, &totalSent, &npackets); // Also when sendfile(2) is refused
+        break;
+    case BACKEND_CHARDEV: rc = spliceBackend(self, &totalSent, &npackets); break;
+    case BACKEND_MEM:
+    default: rc = sendMemory(self, end, &totalSent, &npackets); break;
     }
+    if (rc == 1) copyBackend(self, end, &totalSent, &npackets);
+    unholdBackend(hold);
 
-    syslog(LOG_DEBUG, "[TID: %i] Sent %zi bytes (%zi pkts) to client", self->tid, totalSent, npackets);
+    logMsg(LOG_DEBUG, "[TID: %i] Sent %zi bytes (%zi pkts) to client", self->tid, totalSent, npackets);
     return totalSent;
 }
 
-int acquireBackend(ConnThread *self) {
-    int err = -1;
-    if ((self->fd = open(self->backend, O_CREAT|O_RDWR|O_APPEND, 0644)) == -1) {
-        syslog(LOG_ERR, "ERROR in acquireBackend::open(%s) %m", self->backend);
+// Sends entire BACKEND content to client, served from an immutable
+// History snapshot when the mirror is warm instead of re-reading BACKEND
+ssize_t sendHistory(ConnThread *self) {
+    HistSnapshot snap;
+    size_t off = 0;
+
+    if (snapshotBackend(&snap) == -1) return sendFile(self, SEEK_SET);
+
+    ssize_t totalSent = sendSnapshot(&snap, &off, self->cfd, 0);
+    if (totalSent == -1) logMsg(LOG_ERR, "ERROR in sendHistory::sendmsg(%i): %m", self->cfd);
+    else logMsg(LOG_DEBUG, "[TID: %i] Sent %zi bytes (History) to client", self->tid, totalSent);
+
+    releaseSnapshot(&snap);
+    return totalSent;
+}
+
+// Offset a content response starts from: the oldest content BACKEND
+// retains, or in delta mode the end of the last response
+off_t responseStart(ConnThread *self) {
+    off_t base = backendBase();
+    return self->delta && self->cursor > base ? self->cursor : base;
+}
+
+// Switches to delta mode; the first response then holds all content
+void enableDelta(ConnThread *self) {
+    if (!self->delta) self->cursor = 0;
+    self->delta = 1;
+}
+
+// Sends BACKEND content appended since the last response (delta mode),
+// from a History snapshot when the mirror is warm, and moves cursor
+ssize_t sendDelta(ConnThread *self) {
+    HistSnapshot snap;
+    ssize_t totalSent;
+    size_t off = responseStart(self);
+
+    if (snapshotBackend(&snap) == -1) {
+        self->rpos = off;
+        totalSent = sendFile(self, SEEK_CUR);
+        self->cursor = self->rpos;
+        return totalSent;
     }
-    else if ((err = pthread_mutex_lock(&backendLock)) != 0) {
-        syslog(LOG_ERR, "ERROR in acquireBackend::pthread_mutex_lock(3p): %s", strerror(err));
-        close(self->fd);
-        self->fd = -1;
+
+    if (off > snap.len) off = snap.len;
+    totalSent = sendSnapshot(&snap, &off, self->cfd, 0);
+    if (totalSent == -1) logMsg(LOG_ERR, "ERROR in sendDelta::sendmsg(%i): %m", self->cfd);
+    else logMsg(LOG_DEBUG, "[TID: %i] Sent %zi bytes (delta) to client", self->tid, totalSent);
+
+    self->cursor = off;
+    releaseSnapshot(&snap);
+    return totalSent;
+}
+
+// Uncontended acquisitions record a zero wait without reading the clock
+int lockAppend() {
+    int err;
+    if (pthread_mutex_trylock(&appendLock) == 0) {
+        recordLatency(H_LOCKWAIT, 0);
+        return 0;
     }
 
+    uint64_t t0 = metricsClock();
+    if ((err = pthread_mutex_lock(&appendLock)) != 0)
+        logMsg(LOG_ERR, "ERROR in lockAppend::pthread_mutex_lock(3p): %s", strerror(err));
+    else recordLatency(H_LOCKWAIT, metricsClock() - t0);
     return err;
 }
 
-int releaseBackend(ConnThread *self) {
+int unlockAppend() {
     int err;
-    if ((err = pthread_mutex_unlock(&backendLock)) != 0)
-        syslog(LOG_ERR, "ERROR in releaseBackend::pthread_mutex_unlock(3p): %s", strerror(err));
-    
-    close(self->fd);
-    self->fd = -1;
-    return err;  
+    if ((err = pthread_mutex_unlock(&appendLock)) != 0)
+        logMsg(LOG_ERR, "ERROR in unlockAppend::pthread_mutex_unlock(3p): %s", strerror(err));
+    return err;
 }
 
-// This ioctl command translates to a backend lseek call to 
-// the offset corresponding to the aesd_seekto object params
+// The SEEKTO command resolves, through the write-command index (or the
+// store: driver ioctl for a char device), to the offset corresponding
+// to the aesd_seekto object params, within the content published so
+// far. The resulting offset becomes the per-connection rpos.
 int sendIoctl(ConnThread *self, struct aesd_seekto *pSeekObj) {
-    int err;
-    if ((err = ioctl(self->fd, AESDCHAR_IOCSEEKTO, pSeekObj)) == -1) 
-        syslog(LOG_ERR, "ERROR in sendIoctl::ioctl(2): %m");
-    else syslog(LOG_DEBUG, "[TID: %i] Sent ioctl obj [%u, %u] to %s", self->tid, 
+    off_t end = atomic_load(&backendEnd);
+    off_t pos = seekIndex ? indexSeekto(seekIndex, pSeekObj, end) : store->ops->seekto(store, pSeekObj, end);
+    if (pos == -1) {
+        logMsg(LOG_ERR, "ERROR in sendIoctl::seekto(%s): %m", self->backend);
+        return -1;
+    }
+
+    self->rpos = pos;
+    logMsg(LOG_DEBUG, "[TID: %i] Sent ioctl obj [%u, %u] to %s", self->tid,
         pSeekObj->write_cmd, pSeekObj->write_cmd_offset, self->backend);
-    
-    return err;
+    return 0;
 }
 
-// Extracts ioctl aesd_seekto object if line matches: AESDCHAR_IOCSEEKTO:X,Y
-int matchIoctl(ConnThread *self, LineBuffer *line, struct aesd_seekto *pSeekObj) {
-    regex_t regex;
-    regmatch_t groups[3];
-    char digit[64];
-    size_t n;
+// Sends the metrics report (see metrics.h) to client
+ssize_t sendStats(ConnThread *self) {
+    char text[STATSBUFSZ];
+    ssize_t n = formatStats(text, sizeof(text));
+    if (n == -1) return -1;
 
-    regcomp(&regex, "^AESDCHAR_IOCSEEKTO:([0-9]+),([0-9]+)", REG_EXTENDED);      
-    if (regexec(&regex, line->data, 3, groups, 0) == REG_NOMATCH) return 0;
+    ssize_t off = 0, numSent;
+    while (off < n) {
+        if ((numSent = send(self->cfd, text + off, n - off, MSG_NOSIGNAL)) == -1) {
+            if (errno == EINTR) continue; // Just inturrupted
+            logMsg(LOG_ERR, "ERROR in sendStats::send(%i): %m", self->cfd);
+            return -1;
+        }
+        off += numSent;
+    }
 
-    // Populate aesd_seekto object
-    n = groups[1].rm_eo - groups[1].rm_so;
-    memset((void *)digit, 0, n+1); // Ensure final '\0'
-    stpncpy(digit, &line->data[groups[1].rm_so], n);
-    pSeekObj->write_cmd = (uint32_t)atoi((const char *)digit);
+    logMsg(LOG_DEBUG, "[TID: %i] Sent %zi bytes (stats) to client", self->tid, n);
+    return n;
+}
 
-    n = groups[2].rm_eo - groups[2].rm_so;
-    memset((void *)digit, 0, n+1); // Ensure final '\0'
-    stpncpy(digit, &line->data[groups[2].rm_so], n);
-    pSeekObj->write_cmd_offset = (uint32_t)atoi((const char *)digit);
+// Handles one received line: control lines are recognized by the
+// parseCommand() dispatch table, anything else is plain data.
+// Returns -1 on ERROR (connection should close).
+int dispatchLine(ConnThread *self, LineBuffer *line) {
+    Command cmd;
+    ssize_t numSent;
+    uint64_t t0;
+
+    switch (parseCommand(line->data, line->index, &cmd)) {
+    // If ioctl cmd line, send back content only from new lseek offset
+    case CMD_SEEKTO:
+        if (sendIoctl(self, &cmd.arg.seekto) == -1) return -1; // Ioctl ERROR
+        t0 = metricsClock();
+        numSent = sendFile(self, SEEK_CUR);
+        self->cursor = self->rpos;
+        break;
+
+    // If stats cmd line, send back the metrics report only
+    case CMD_STATS:
+        t0 = metricsClock();
+        numSent = sendStats(self);
+        break;
+
+    // If delta cmd line, switch to delta mode and send back content up to now
+    case CMD_DELTA:
+        enableDelta(self);
+        t0 = metricsClock();
+        numSent = sendDelta(self);
+        break;
+
+    // If standard line, write it to backend and send back entire content
+    // (or what was appended since the last response, in delta mode)
+    case CMD_NONE:
+    default:
+        if (writeFile(self, line) != line->index) return -1; // Write ERROR
+        else if (durableEnabled() && waitDurable(self->wend) == -1) return -1; // Sync ERROR
+        t0 = metricsClock();
+        numSent = self->delta ? sendDelta(self) : sendHistory(self);
+        break;
+    }
 
-    syslog(LOG_DEBUG, "[TID: %i] Extracted aesd_seekto obj: [%u, %u]", 
-        self->tid, pSeekObj->write_cmd, pSeekObj->write_cmd_offset);
-    return 1;
+    if (numSent == -1) return -1; // Send ERROR
+    recordLatency(H_SEND, metricsClock() - t0);
+    countMetric(M_SENT, numSent);
+    return 0;
 }
 
-void *connThreadMain(void *vself) {
-    ConnThread *self = (ConnThread *)vself;
-
+// Serves lines from self->cfd until EOF, ERROR or _exitflag, reusing
+// line as scratch buffer. Caller owns (and closes) self->cfd.
+void serveConnection(ConnThread *self, LineBuffer *line) {
     // Get and log client info
     char ipaddr[INET_ADDRSTRLEN];
     const char *dst = inet_ntop(AF_INET, ((struct sockaddr *)&self->claddr)->sa_data, ipaddr, INET_ADDRSTRLEN);
-    syslog(LOG_DEBUG, "[TID: %i] Accepted connection from %s", self->tid, dst ? ipaddr : "0.0.0.0");
+    logMsg(LOG_DEBUG, "[TID: %i] Accepted connection from %s", self->tid, dst ? ipaddr : "0.0.0.0");
 
-    int isioctl;
-    size_t lsz;
-    ssize_t numSent;
-    struct aesd_seekto seekObj;
-    LineBuffer line = newLineBuffer();
+    ssize_t lsz;
     
     // Until EOF on cfd, read lines from connection
     while (!self->_exitflag) {
-        if ((lsz = readLine(self, &line)) == 0) break; // EOF
+        if ((lsz = readLine(self, line)) == 0) break; // EOF
         else if (lsz == -1) break; // Read ERROR
-        else if (acquireBackend(self) != 0)  break; // Open/lock backend ERROR
 
-        // If ioctl cmd line, send back content only from new lseek offset
-        if (matchIoctl(self, &line, &seekObj)) {
-            if (sendIoctl(self, &seekObj) == -1) break; // Ioctl ERROR
-            else if ((numSent = sendFile(self, SEEK_CUR)) == -1) break; // Send ERROR
-            else if (releaseBackend(self) != 0) break; // Close/unlock backend ERROR
-        }
-        // If standard line, write it to backend and send back entire content  
-        else {
-            if (writeFile(self, &line) != lsz) break; // Write ERROR
-            else if ((numSent = sendFile(self, SEEK_SET)) == -1) break; // Send ERROR
-            else if (releaseBackend(self) != 0) break; // Close/unlock backend ERROR
-        }
+        gatherBatch(self, line);
+        if (dispatchLine(self, line) == -1) break; // Ioctl/Write/Send ERROR
     }
     
+    logMsg(LOG_DEBUG, "[TID: %i] Closed connection from %s", self->tid, dst ? ipaddr : "0.0.0.0");
+}
+
+void *connThreadMain(void *vself) {
+    ConnThread *self = (ConnThread *)vself;
+    LineBuffer line = newLineBuffer();
+
+    serveConnection(self, &line);
+
     destroy(&line);
-    close(self->cfd);
-    if (self->fd != -1) releaseBackend(self);
-    syslog(LOG_DEBUG, "[TID: %i] Closed connection from %s", self->tid, ipaddr);
+    if (self->registry) closeConnFd(self->registry, self);
+    else close(self->cfd);
+    countMetric(M_CLOSED, 1);
     self->_doneFlag = 1;
+    if (self->registry) completeConn(self->registry, self);
     return vself;
 }
@@ -1,7 +1,11 @@
 #ifndef CONNTHREAD_H
 #define CONNTHREAD_H
 
-#include "../aesd-char-driver/aesd_ioctl.h"
+#include "backend.h"
+#include "command.h"
+#include "history.h"
+#include "seekindex.h"
+#include "slab.h"
 
 #include <pthread.h>
 #include <signal.h>
@@ -11,8 +15,9 @@
 #include <unistd.h>
 
 /* 
-    Simple append-only buffer struct with automatic memory
-    realloc (buffer length doubles) when size is exceeded.
+    Simple append-only buffer struct with automatic growth (buffer
+    length doubles) when size is exceeded. Storage comes from the
+    pooled size classes of allocBlock(), so it is recycled.
     Null terminating byte is always automatically appended. 
     Call reset() to move append index to beginning of buffer.
     Call destroy() to free buffer after use.
@@ -25,40 +30,105 @@ typedef struct {
 
 LineBuffer newLineBuffer();
 int append(LineBuffer *self, char ch);
+int appendBytes(LineBuffer *self, const char *bytes, size_t n);
 void reset(LineBuffer *self);
 void destroy(LineBuffer *self);
 
+/* 
+    Per-connection receive buffer. Bytes are recv'd in RECVBUFSZ 
+    chunks and handed out one line at a time by takeLine(), which 
+    keeps any bytes past the first '\n' for the next call so that 
+    pipelined input is never lost. Only refill once drained.
+*/
+#define RECVBUFSZ 16384
+
+typedef struct {
+    size_t head, tail;
+    char data[RECVBUFSZ];
+} RecvBuffer;
+
+void resetRecvBuffer(RecvBuffer *self);
+ssize_t fillRecvBuffer(RecvBuffer *self, int cfd);
+int takeLine(RecvBuffer *self, LineBuffer *line);
+int takeDataLine(RecvBuffer *self, LineBuffer *line);
+
 /* 
     Main ConnThread struct for TCP-connection-per-thread design.
     Maintains all data needed by thread and fcns to read/write 
     TCP connections and BACKEND and exit/done communication.
-    Also maintains *next pointer for use in Singly Linked List.
+    BACKEND is accessed with positional I/O only (through the shared
+    Backend), so connections never depend on a shared file position.
+    Also maintains prev/next pointers for the ConnRegistry Doubly
+    Linked List and doneNext for its stack of finished threads.
+    A plain line is answered with the entire BACKEND content, unless
+    the client sent AESDSOCKET_DELTA first: from then on each response
+    holds only what BACKEND gained since cursor, the end of the last
+    response, lines of other clients included (the DELTA line itself
+    is answered with everything up to now).
 */
 typedef struct ConnThread ConnThread;
+typedef struct ConnRegistry ConnRegistry;
 
 struct ConnThread {
-    int cfd, fd;
+    int cfd, fd;         // fd is the shared BACKEND fd (-1 for mem), never closed here
+    off_t rpos;          // Per-connection BACKEND read cursor
+    off_t wend;          // End offset of its last append (durable mode waits on it)
+    int delta;           // Delta mode, negotiated by AESDSOCKET_DELTA
+    off_t cursor;        // End offset of the content last sent back
     const char *backend;
     unsigned int tid;
     pthread_t thread;
     struct sockaddr_storage claddr;
+    RecvBuffer rx;
 
     sig_atomic_t _exitflag;
     sig_atomic_t _doneFlag;
+    ConnRegistry *registry; // Notified when thread finishes, if set
 
-    ConnThread *next;
+    ConnThread *prev, *next, *doneNext;
 };
 
 ConnThread *newConnThread(const char *backend);
+void resetConnThread(ConnThread *self);
+void freeConnThread(ConnThread *self);
+void logPoolStats();
+void destroyPools();
+void attachHistory(History *hist);
+int attachSeekIndex(SeekIndex *index);
+void enableBatching(int on);
+int gatherBatch(ConnThread *self, LineBuffer *line);
+int snapshotBackend(HistSnapshot *snap);
+
 ssize_t readLine(ConnThread *self, LineBuffer *line);
 ssize_t writeFile(ConnThread *self, LineBuffer *line);
+ssize_t formatTimestamp(char *buf, size_t bufsz);
 ssize_t writeTimestamp(const char *backend);
 ssize_t sendFile(ConnThread *self, int whence);
+ssize_t sendHistory(ConnThread *self);
+void enableDelta(ConnThread *self);
+off_t responseStart(ConnThread *self);
+ssize_t sendDelta(ConnThread *self);
+ssize_t sendStats(ConnThread *self);
+void serveConnection(ConnThread *self, LineBuffer *line);
 void *connThreadMain(void *vself);
 
-int acquireBackend(ConnThread *self);
-int releaseBackend(ConnThread *self);
+int attachBackend(Backend *backend);
+BackendKind backendKind();
+int backendFileno();
+off_t backendBase();
+const char *viewBackend(off_t off, off_t end, size_t *n, void **pin);
+void releaseView(void *pin);
+off_t holdBackend(off_t off, long *token);
+void unholdBackend(long token);
+off_t mappedEnd(off_t end);
+ssize_t readBackend(char *buf, size_t n, off_t off);
+ssize_t appendBackend(const char *data, size_t n, off_t off);
+off_t reserveAppend(size_t n);
+int publishAppend(const char *data, off_t off, size_t n, int ok);
+off_t observeBackendEnd();
+int lockAppend();
+int unlockAppend();
 int sendIoctl(ConnThread *self, struct aesd_seekto *pSeekObj);
-int matchIoctl(ConnThread *self, LineBuffer *line, struct aesd_seekto *pSeekObj);
+int dispatchLine(ConnThread *self, LineBuffer *line);
 
 #endif /* CONNTHREAD_H */
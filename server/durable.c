@@ -0,0 +1,199 @@
+#include "durable.h"
+#include "logger.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// syncLock covers the batch being collected, the syncer's run state
+// and the watcher list. synced and failed are also read without it.
+static pthread_mutex_t syncLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kickCond;                            // Syncer waits
+static pthread_cond_t doneCond = PTHREAD_COND_INITIALIZER; // Writers wait
+static pthread_t syncer;
+static Backend *store = NULL;
+static long window = 0;          // Batch window (us)
+static long maxBatch = DURABLEBATCH;
+static int running = 0;
+static off_t requested = 0;      // Highest end offset awaited
+static long npending = 0;        // Appends in the batch being collected
+static _Atomic off_t synced = 0; // Highest end offset known durable
+static atomic_int failed;
+static int watchers[MAXWATCHERS];
+static int nwatchers = 0;
+
+
+// Wakes every watching event loop after a flush (call with syncLock)
+static void notifyWatchers() {
+    uint64_t one = 1;
+    for (int i = 0; i < nwatchers; i++) {
+        if (write(watchers[i], &one, sizeof(one)) == -1 && errno != EAGAIN)
+            logMsg(LOG_ERR, "ERROR in notifyWatchers::write(%i): %m", watchers[i]);
+    }
+}
+
+static void *syncerMain(void *unused) {
+    struct timespec deadline;
+    (void)unused;
+
+    pthread_mutex_lock(&syncLock);
+    while (1) {
+        // Requests that arrived during the last flush may already be
+        // covered by it; restart the count so the next one kicks us
+        while (running && requested <= atomic_load(&synced)) {
+            npending = 0;
+            pthread_cond_wait(&kickCond, &syncLock);
+        }
+        if (requested <= atomic_load(&synced)) break; // Stopped, nothing pending
+
+        // Hold the batch open for the window unless it fills up first
+        if (running && window > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += (window % 1000000) * 1000;
+            deadline.tv_sec += window / 1000000 + deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            while (running && npending < maxBatch &&
+                pthread_cond_timedwait(&kickCond, &syncLock, &deadline) != ETIMEDOUT) ;
+        }
+
+        off_t target = requested;
+        npending = 0;
+        pthread_mutex_unlock(&syncLock);
+
+        uint64_t t0 = metricsClock();
+        int rc = store->ops->flush(store);
+        recordLatency(H_SYNC, metricsClock() - t0);
+        countMetric(M_SYNCS, 1);
+        if (rc == -1) logMsg(LOG_ERR, "ERROR in syncerMain::flush(%s): %m", store->path);
+
+        pthread_mutex_lock(&syncLock);
+        if (rc == -1) atomic_store(&failed, 1);
+        else atomic_store(&synced, target);
+        pthread_cond_broadcast(&doneCond);
+        notifyWatchers();
+        if (rc == -1) break;
+    }
+    pthread_mutex_unlock(&syncLock);
+    return NULL;
+}
+
+// Starts the syncer thread for store, call after any fork.
+// Returns -1 on ERROR.
+int startDurable(Backend *backend, long windowus, long maxbatch) {
+    pthread_condattr_t attr;
+    int err;
+
+    store = backend;
+    window = windowus > 0 ? windowus : 0;
+    maxBatch = maxbatch > 0 ? maxbatch : DURABLEBATCH;
+    requested = npending = 0;
+    atomic_store(&synced, store->ops->size(store));
+    atomic_init(&failed, 0);
+
+    // Batch windows are timed on the monotonic clock
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&kickCond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    running = 1;
+    if ((err = pthread_create(&syncer, NULL, syncerMain, NULL)) != 0) {
+        logMsg(LOG_ERR, "ERROR in startDurable::pthread_create(3): %s", strerror(err));
+        running = 0;
+        pthread_cond_destroy(&kickCond);
+        store = NULL;
+        return -1;
+    }
+
+    logMsg(LOG_DEBUG, "Durable mode: %li us window, %li appends per batch", window, maxBatch);
+    return 0;
+}
+
+// Flushes what is still requested and stops the syncer. Call once
+// no thread is left waiting on an append.
+void stopDurable() {
+    if (store == NULL) return;
+
+    pthread_mutex_lock(&syncLock);
+    running = 0;
+    pthread_cond_signal(&kickCond);
+    pthread_mutex_unlock(&syncLock);
+
+    pthread_join(syncer, NULL);
+    pthread_cond_destroy(&kickCond);
+    store = NULL;
+}
+
+int durableEnabled() {
+    return store != NULL;
+}
+
+// Adds an append ending at end (already published) to the current batch
+void requestDurable(off_t end) {
+    pthread_mutex_lock(&syncLock);
+    if (end > requested) requested = end;
+    npending += 1;
+    // The syncer needs waking for a new batch, or to cut a full one short
+    if (npending == 1 || npending == maxBatch) pthread_cond_signal(&kickCond);
+    pthread_mutex_unlock(&syncLock);
+    countMetric(M_DURABLE, 1);
+}
+
+// Returns 1 if BACKEND is durable up to end, 0 if not yet,
+// -1 if a flush failed first (errno EIO)
+int isDurable(off_t end) {
+    if (atomic_load(&synced) >= end) return 1;
+    else if (atomic_load(&failed)) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+// Blocks until BACKEND is durable up to end. Returns -1 (errno EIO)
+// if a flush failed first.
+int waitDurable(off_t end) {
+    int rc;
+
+    pthread_mutex_lock(&syncLock);
+    while ((rc = isDurable(end)) == 0) pthread_cond_wait(&doneCond, &syncLock);
+    pthread_mutex_unlock(&syncLock);
+    return rc == 1 ? 0 : -1;
+}
+
+// Returns a new eventfd, readable after every flush, or -1 on ERROR
+int watchDurable() {
+    int efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (efd == -1) {
+        logMsg(LOG_ERR, "ERROR in watchDurable::eventfd(2): %m");
+        return -1;
+    }
+
+    pthread_mutex_lock(&syncLock);
+    if (nwatchers == MAXWATCHERS) {
+        pthread_mutex_unlock(&syncLock);
+        logMsg(LOG_ERR, "ERROR in watchDurable: more than %i watchers", MAXWATCHERS);
+        close(efd);
+        return -1;
+    }
+    watchers[nwatchers++] = efd;
+    pthread_mutex_unlock(&syncLock);
+    return efd;
+}
+
+void unwatchDurable(int efd) {
+    pthread_mutex_lock(&syncLock);
+    for (int i = 0; i < nwatchers; i++) {
+        if (watchers[i] != efd) continue;
+        watchers[i] = watchers[--nwatchers];
+        break;
+    }
+    pthread_mutex_unlock(&syncLock);
+    close(efd);
+}
@@ -0,0 +1,32 @@
+#ifndef DURABLE_H
+#define DURABLE_H
+
+#include "backend.h"
+
+#include <sys/types.h>
+
+#define DURABLEBATCH 64  // Default max appends per fdatasync (-G)
+#define MAXWATCHERS 64   // Event loops that may watchDurable()
+
+/*
+    Group commit for the file backend (-D window_us). Appends publish
+    as usual and then request durability up to their end offset. One
+    syncer thread holds each batch open for window_us after its first
+    request, or until maxbatch appends are waiting, and covers the
+    whole batch with a single flush (fdatasync); with window_us 0 a
+    batch is whatever queued up during the previous flush. A response
+    is released only once its append is durable: threads block in
+    waitDurable(), event loops poll isDurable() and watch the eventfd
+    from watchDurable(), which is signalled after every flush. A failed
+    flush is sticky, every later wait fails with EIO.
+*/
+int startDurable(Backend *backend, long windowus, long maxbatch);
+void stopDurable();
+int durableEnabled();
+void requestDurable(off_t end);
+int isDurable(off_t end);
+int waitDurable(off_t end);
+int watchDurable();
+void unwatchDurable(int efd);
+
+#endif /* DURABLE_H */
@@ -0,0 +1,656 @@
+#define _GNU_SOURCE // accept4(2), pthread_setaffinity_np(3)
+
+#include "epollloop.h"
+#include "durable.h"
+#include "logger.h"
+#include "metrics.h"
+#include "sigtimer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+
+#define MAXEVENTS 64
+
+// Tags distinguishing non-connection fds in epoll_event.data.ptr
+static int listenTag, signalTag, timerTag, stopTag, durableTag;
+static Slab connSlab; // Recycled EpollConn structs
+static size_t outLimit = 0; // Max queued response bytes per client, 0 = none
+static LagPolicy lagPolicy = LAG_DISCONNECT;
+
+
+void setOutputLimit(size_t maxbytes, LagPolicy policy) {
+    outLimit = maxbytes;
+    lagPolicy = policy;
+}
+
+
+static EpollConn *newEpollConn(const char *backend) {
+    EpollConn *c = (EpollConn *)slabAlloc(&connSlab);
+    if (c == NULL) {
+        logMsg(LOG_ERR, "ERROR in newEpollConn::slabAlloc: %m");
+        return NULL;
+    }
+    else if ((c->ct = newConnThread(backend)) == NULL) {
+        slabFree(&connSlab, c);
+        return NULL;
+    }
+
+    c->line = newLineBuffer();
+    c->eof = 0;
+    c->zerocopy = 0;
+    c->qhead = c->qlen = 0;
+    c->shead = c->stail = 0;
+    c->prev = c->next = NULL;
+    return c;
+}
+
+static OutItem *outHead(EpollConn *c) {
+    return &c->outq[c->qhead];
+}
+
+static void releaseOutItem(OutItem *it) {
+    if (it->hold != -1) unholdBackend(it->hold);
+    it->hold = -1;
+    if (it->usesnap) releaseSnapshot(&it->snap);
+    if (it->text) freeBlock(it->text, it->textsz);
+    it->text = NULL;
+}
+
+static void popOutItem(EpollConn *c) {
+    releaseOutItem(outHead(c));
+    c->qhead = (c->qhead + 1) % OUTQDEPTH;
+    c->qlen -= 1;
+    c->shead = c->stail = 0;
+}
+
+// Bytes of the responses queued behind the one at the head of outq:
+// how far the client has fallen behind, whatever size one response is
+static size_t backlogBytes(EpollConn *c) {
+    size_t n = 0;
+    for (int i = 1; i < c->qlen; i++) {
+        OutItem *it = &c->outq[(c->qhead + i) % OUTQDEPTH];
+        n += it->usesnap ? it->snap.len - it->snapoff : (size_t)(it->send - it->soff);
+    }
+    return n;
+}
+
+// Moves the start of a response not yet sent up to the first line
+// starting in its last limit bytes (its end if none does)
+static void cutToLine(OutItem *it, size_t limit) {
+    char block[512];
+    ssize_t n;
+
+    if (it->usesnap) {
+        if (it->snap.len - it->snapoff <= limit) return;
+        struct iovec iov[8];
+        size_t off = it->snap.len - limit - 1;
+        while (off < it->snap.len) {
+            int cnt = snapshotIov(&it->snap, off, iov, 8);
+            if (cnt <= 0) break;
+            for (int i = 0; i < cnt; i++) {
+                const char *data = (const char *)iov[i].iov_base;
+                const char *eol = memchr(data, '\n', iov[i].iov_len);
+                if (eol) {
+                    it->snapoff = off + (eol - data) + 1;
+                    return;
+                }
+                off += iov[i].iov_len;
+            }
+        }
+        it->snapoff = it->snap.len;
+        return;
+    }
+
+    if ((size_t)(it->send - it->soff) <= limit) return;
+    off_t off = it->send - limit - 1;
+    // The retained window starts on a line
+    if (off < backendBase()) {
+        it->soff = backendBase();
+        return;
+    }
+    for (; off < it->send; off += n) {
+        size_t want = it->send - off < (off_t)sizeof(block) ? (size_t)(it->send - off) : sizeof(block);
+        if ((n = readBackend(block, want, off)) <= 0) break;
+        const char *eol = memchr(block, '\n', n);
+        if (eol == NULL) continue;
+        it->soff = off + (eol - block) + 1;
+        return;
+    }
+    it->soff = it->send;
+}
+
+// LAG_TRUNCATE: keeps only the newest response, cut to the whole lines
+// in its last limit bytes. A head response already in flight (partly
+// sent, or held for group commit) is kept whole ahead of it, never
+// torn or dropped.
+static void truncateOutput(EpollConn *c, size_t limit) {
+    OutItem *head = outHead(c);
+    if (head->started || head->durable) {
+        if (c->qlen == 1) return;
+        for (int i = 1; i < c->qlen - 1; i++) releaseOutItem(&c->outq[(c->qhead + i) % OUTQDEPTH]);
+        c->outq[(c->qhead + 1) % OUTQDEPTH] = c->outq[(c->qhead + c->qlen - 1) % OUTQDEPTH];
+        c->qlen = 2;
+    }
+    else while (c->qlen > 1) popOutItem(c);
+
+    OutItem *it = &c->outq[(c->qhead + c->qlen - 1) % OUTQDEPTH];
+    if (!it->text && !it->started) cutToLine(it, limit);
+}
+
+static void closeEpollConn(EpollConn *c) {
+    while (c->qlen > 0) popOutItem(c);
+    destroy(&c->line);
+    if (c->ct->cfd != -1) {
+        close(c->ct->cfd);
+        countMetric(M_CLOSED, 1);
+    }
+    logMsg(LOG_DEBUG, "[TID: %i] Closed connection", c->ct->tid);
+    freeConnThread(c->ct);
+    slabFree(&connSlab, c);
+}
+
+static EpollConn *unlinkEpollConn(EpollConn *head, EpollConn *c) {
+    if (c->prev) c->prev->next = c->next;
+    else head = c->next;
+    if (c->next) c->next->prev = c->prev;
+    return head;
+}
+
+// Queues BACKEND content from responseStart(): a History snapshot when
+// the mirror is warm, else a backend range (its end is observed later)
+static void queueContent(ConnThread *ct, OutItem *it) {
+    off_t start = responseStart(ct);
+
+    if (snapshotBackend(&it->snap) == 0) {
+        it->usesnap = 1;
+        it->snapoff = (size_t)start < it->snap.len ? (size_t)start : it->snap.len;
+        ct->cursor = it->snap.len;
+    }
+    else it->soff = start;
+}
+
+// Applies the buffered line to the backend (appends commit under the
+// short appendLock) and queues what to send back: a History snapshot,
+// or the backend range [soff, send) as observed right after the line.
+// Enforces the output limit policy on the resulting queue.
+static int processLine(EpollConn *c) {
+    ConnThread *ct = c->ct;
+    OutItem *it = &c->outq[(c->qhead + c->qlen) % OUTQDEPTH];
+    Command cmd;
+    int status = 0;
+
+    it->usesnap = 0;
+    it->started = 0;
+    it->hold = -1;
+    it->text = NULL;
+    it->durable = 0;
+    switch (parseCommand(c->line.data, c->line.index, &cmd)) {
+    // If ioctl cmd line, send back content only from new lseek offset
+    case CMD_SEEKTO:
+        if (sendIoctl(ct, &cmd.arg.seekto) == -1) status = -1;
+        else it->soff = ct->rpos;
+        break;
+
+    // If stats cmd line, send back the metrics report only
+    case CMD_STATS:
+        it->textsz = STATSBUFSZ;
+        if ((it->text = (char *)allocBlock(&it->textsz)) == NULL) status = -1;
+        else if ((it->send = formatStats(it->text, it->textsz)) == -1) {
+            freeBlock(it->text, it->textsz);
+            it->text = NULL;
+            status = -1;
+        }
+        else it->soff = 0;
+        break;
+
+    // If delta cmd line, switch to delta mode and send back content up to now
+    case CMD_DELTA:
+        enableDelta(ct);
+        queueContent(ct, it);
+        break;
+
+    // If standard line, write it to backend and send back entire content
+    // (or what was appended since the last response, in delta mode)
+    case CMD_NONE:
+        if (writeFile(ct, &c->line) != c->line.index) {
+            status = -1;
+            break;
+        }
+        if (durableEnabled()) it->durable = ct->wend; // Held until flushed
+        queueContent(ct, it);
+        break;
+    }
+
+    if (status == 0 && !it->usesnap && !it->text && (it->send = observeBackendEnd()) == -1) status = -1;
+    else if (status == 0 && !it->usesnap && !it->text) {
+        // A char device may have dropped writes past an old cursor
+        if (it->soff > it->send) it->soff = it->send;
+        ct->cursor = it->send;
+    }
+    reset(&c->line);
+    if (status == -1) return -1;
+    c->qlen += 1;
+
+    if (outLimit && backlogBytes(c) > outLimit) {
+        if (lagPolicy == LAG_DISCONNECT) {
+            logMsg(LOG_DEBUG, "[TID: %i] Disconnecting laggard (%zu bytes queued)", ct->tid, backlogBytes(c));
+            // Reset instead of a clean close, so the client sees it was cut off
+            struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+            if (setsockopt(ct->cfd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg)) == -1)
+                logMsg(LOG_ERR, "ERROR in processLine::setsockopt(%i, SO_LINGER): %m", ct->cfd);
+            return -1;
+        }
+        logMsg(LOG_DEBUG, "[TID: %i] Truncating laggard output to %zu bytes", ct->tid, outLimit);
+        truncateOutput(c, outLimit);
+    }
+    return 0;
+}
+
+// Sends the response at the head of outq without blocking. Returns 1
+// when complete, 0 if socket would block and -1 on error.
+static int sendPending(EpollConn *c) {
+    ConnThread *ct = c->ct;
+    OutItem *it = outHead(c);
+    ssize_t n;
+
+    if (it->usesnap) {
+        size_t snapoff = it->snapoff;
+        n = sendSnapshot(&it->snap, &it->snapoff, ct->cfd, 0);
+        countMetric(M_SENT, it->snapoff - snapoff);
+        if (it->snapoff != snapoff) it->started = 1;
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            logMsg(LOG_ERR, "ERROR in sendPending::sendmsg(%i): %m", ct->cfd);
+            return -1;
+        }
+        return 1;
+    }
+
+    // Retention keeps the rest of the range until the item is popped
+    if (!it->text && !it->started && it->hold == -1) it->soff = holdBackend(it->soff, &it->hold);
+
+    while (1) {
+        // Stats text and mapped BACKEND content (mem store, segments, or
+        // a regular file once sendfile(2) is refused) are sent straight
+        // from memory. sbuf is drained before a mapping is used.
+        const char *mem = it->text ? it->text + it->soff : NULL;
+        size_t avail = it->send - it->soff;
+        void *pin = NULL;
+        if (!it->text && !c->zerocopy && c->shead == c->stail && it->soff < it->send)
+            mem = viewBackend(it->soff, it->send, &avail, &pin);
+        if (mem && it->soff < it->send) {
+            n = send(ct->cfd, mem, avail, MSG_NOSIGNAL);
+            releaseView(pin);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                else if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                logMsg(LOG_ERR, "ERROR in sendPending::send(%i): %m", ct->cfd);
+                return -1;
+            }
+            it->soff += n;
+            it->started = 1;
+            countMetric(M_SENT, n);
+            continue;
+        }
+        else if (it->text) return 1;
+
+        if (c->zerocopy && c->shead == c->stail && it->soff < it->send) {
+            if ((n = sendfile(ct->cfd, ct->fd, &it->soff, it->send - it->soff)) == -1) {
+                if (errno == EINTR) continue;
+                else if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                else if (errno == EINVAL || errno == ENOSYS) c->zerocopy = 0; // Fall back to copy
+                else {
+                    logMsg(LOG_ERR, "ERROR in sendPending::sendfile(%i): %m", ct->cfd);
+                    return -1;
+                }
+            }
+            else if (n == 0) return 1; // Backend shrank, nothing left
+            it->started = 1;
+            countMetric(M_SENT, n);
+            continue;
+        }
+
+        if (c->shead == c->stail) {
+            if (it->soff >= it->send) return 1;
+
+            size_t want = sizeof(c->sbuf);
+            if ((off_t)want > it->send - it->soff) want = it->send - it->soff;
+            if ((n = readBackend(c->sbuf, want, it->soff)) == -1) {
+                logMsg(LOG_ERR, "ERROR in sendPending::read(%s): %m", ct->backend);
+                return -1;
+            }
+            else if (n == 0) return 1; // Backend shrank, nothing left
+
+            c->shead = 0;
+            c->stail = n;
+            it->soff += n;
+            it->started = 1;
+        }
+
+        if ((n = send(ct->cfd, &c->sbuf[c->shead], c->stail - c->shead, MSG_NOSIGNAL)) == -1) {
+            if (errno == EINTR) continue;
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            logMsg(LOG_ERR, "ERROR in sendPending::send(%i): %m", ct->cfd);
+            return -1;
+        }
+        c->shead += n;
+        countMetric(M_SENT, n);
+    }
+}
+
+// Drives connection until both directions would block. Edge-triggered
+// readiness requires draining each direction until EAGAIN: outq is
+// flushed first, then input is consumed while outq has room.
+// Returns -1 when connection is finished (EOF or ERROR) and should close.
+static int serviceConn(EpollConn *c) {
+    ConnThread *ct = c->ct;
+    int wblocked = 0;
+    ssize_t n;
+    int rc;
+
+    while (1) {
+        while (c->qlen > 0 && !wblocked) {
+            // A response held for group commit resumes on durfd
+            if (outHead(c)->durable && (rc = isDurable(outHead(c)->durable)) != 1) {
+                if (rc == -1) return -1;
+                break;
+            }
+            uint64_t t0 = metricsClock();
+            rc = sendPending(c);
+            recordLatency(H_SEND, metricsClock() - t0);
+            if (rc == -1) return -1;
+            else if (rc == 0) wblocked = 1;
+            else popOutItem(c);
+        }
+        if (c->qlen == OUTQDEPTH) return 0; // Resume on EPOLLOUT
+
+        if ((rc = takeLine(&ct->rx, &c->line)) == -1) return -1;
+        else if (rc == 1) {
+            gatherBatch(ct, &c->line);
+            if (processLine(c) == -1) return -1;
+            continue;
+        }
+        else if (c->eof) {
+            // Flush final unterminated line as readLine() does
+            if (c->line.index > 0) {
+                if (processLine(c) == -1) return -1;
+                continue;
+            }
+            return c->qlen > 0 ? 0 : -1; // Close once outq drains
+        }
+
+        if ((n = fillRecvBuffer(&ct->rx, ct->cfd)) == -1) {
+            if (errno == EINTR) continue;
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            logMsg(LOG_ERR, "ERROR in serviceConn::recv(%i): %m", ct->cfd);
+            return -1;
+        }
+        else if (n == 0) c->eof = 1;
+    }
+}
+
+// Accepts all pending clients on non-blocking listen socket. An
+// EpollConn is only taken once accept4 yields a client. Running out of
+// fds or memory stops short of draining the edge-triggered listener,
+// so *stalled is set and the shard calls again after its next wakeup.
+static EpollConn *acceptAll(int epfd, int sfd, const char *backend, EpollConn *head, int *stalled) {
+    while (1) {
+        struct sockaddr_storage claddr;
+        socklen_t addrlen = sizeof(claddr);
+        int cfd = accept4(sfd, (struct sockaddr *)&claddr, &addrlen, SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (cfd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                *stalled = 0;
+                return head;
+            }
+            // Log once per stall, not on every retry
+            if (!*stalled) logMsg(LOG_ERR, "ERROR in acceptAll::accept4(2): %m");
+            *stalled = 1;
+            return head;
+        }
+        countMetric(M_ACCEPTED, 1);
+
+        EpollConn *c = newEpollConn(backend);
+        if (c == NULL) {
+            close(cfd);
+            countMetric(M_CLOSED, 1);
+            *stalled = 1;
+            return head;
+        }
+        ConnThread *ct = c->ct;
+        ct->cfd = cfd;
+        ct->claddr = claddr;
+
+        c->zerocopy = backendKind() == BACKEND_FILE && backendFileno() != -1;
+        struct epoll_event ev;
+        ev.events = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, ct->cfd, &ev) == -1) {
+            logMsg(LOG_ERR, "ERROR in acceptAll::epoll_ctl(%i): %m", ct->cfd);
+            closeEpollConn(c);
+            continue;
+        }
+
+        logMsg(LOG_DEBUG, "[TID: %i] Accepted connection (epoll)", ct->tid);
+        c->next = head;
+        if (head) head->prev = c;
+        head = c;
+    }
+}
+
+// Services every connection whose next response was held for group
+// commit, after a flush. Returns the new list head.
+static EpollConn *releaseDurable(EpollConn *head) {
+    EpollConn *c = head, *nxt;
+    for (; c; c = nxt) {
+        nxt = c->next;
+        if (c->qlen == 0 || outHead(c)->durable == 0 || serviceConn(c) != -1) continue;
+        head = unlinkEpollConn(head, c);
+        closeEpollConn(c);
+    }
+    return head;
+}
+
+// Adds fd to the shard's epoll set, tagged with ptr
+static int watchFd(int epfd, int fd, void *ptr) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN|EPOLLET;
+    ev.data.ptr = ptr;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        logMsg(LOG_ERR, "ERROR in watchFd::epoll_ctl(%i): %m", fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Pins the calling thread to the shard's CPU
+static void pinShard(EpollShard *sh) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(sh->cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) logMsg(LOG_ERR, "ERROR in pinShard::pthread_setaffinity_np(%i): %s", sh->cpu, strerror(err));
+}
+
+// Event loop of one shard until stopped by a signal (shard 0) or by stopfd
+static int runEpollShard(EpollShard *sh) {
+    EpollConn *head = NULL;
+    struct epoll_event events[MAXEVENTS];
+    int epfd = -1;
+    int retstatus = 0;
+    int done = 0;
+    int stalled = 0; // Listener left undrained by acceptAll()
+
+    if (sh->nshards > 1) pinShard(sh);
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        logMsg(LOG_ERR, "ERROR in runEpollShard::epoll_create1(2): %m");
+        return -1;
+    }
+
+    int flags = fcntl(sh->sfd, F_GETFL);
+    if (flags == -1 || fcntl(sh->sfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        logMsg(LOG_ERR, "ERROR in runEpollShard::fcntl(%i): %m", sh->sfd);
+        retstatus = -1;
+        done = 1;
+    }
+    else if (watchFd(epfd, sh->sfd, &listenTag) == -1 || watchFd(epfd, sh->stopfd, &stopTag) == -1) {
+        retstatus = -1;
+        done = 1;
+    }
+    else if (sh->sigfd != -1 && watchFd(epfd, sh->sigfd, &signalTag) == -1) {
+        retstatus = -1;
+        done = 1;
+    }
+    else if (sh->tfd != -1 && watchFd(epfd, sh->tfd, &timerTag) == -1) {
+        retstatus = -1;
+        done = 1;
+    }
+    else if (durableEnabled() && ((sh->durfd = watchDurable()) == -1 || watchFd(epfd, sh->durfd, &durableTag) == -1)) {
+        retstatus = -1;
+        done = 1;
+    }
+
+    while (!done) {
+        int ready = epoll_wait(epfd, events, MAXEVENTS, -1);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            logMsg(LOG_ERR, "ERROR in runEpollShard::epoll_wait(2): %m");
+            retstatus = -1;
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == &listenTag) head = acceptAll(epfd, sh->sfd, sh->backend, head, &stalled);
+            else if (ptr == &stopTag) done = 1;
+            else if (ptr == &signalTag) {
+                if (readExitSignal(sh->sigfd)) done = 1;
+            }
+            else if (ptr == &timerTag) {
+                if (readTimer(sh->tfd) > 0 && writeTimestamp(sh->backend) == -1) {
+                    retstatus = -1;
+                    done = 1;
+                }
+            }
+            else if (ptr == &durableTag) {
+                uint64_t n;
+                if (read(sh->durfd, &n, sizeof(n)) == sizeof(n)) head = releaseDurable(head);
+            }
+            else {
+                EpollConn *c = (EpollConn *)ptr;
+                if (serviceConn(c) == -1) {
+                    // Closing cfd also removes it from the epoll interest list
+                    head = unlinkEpollConn(head, c);
+                    closeEpollConn(c);
+                }
+            }
+        }
+        // No new edge comes for clients already queued, so retry once
+        // something (usually a close) may have freed an fd or memory
+        if (stalled && !done) head = acceptAll(epfd, sh->sfd, sh->backend, head, &stalled);
+    }
+
+    int pcnt = 0;
+    while (head) {
+        EpollConn *nxt = head->next;
+        closeEpollConn(head);
+        head = nxt;
+        pcnt += 1;
+    }
+    logMsg(LOG_DEBUG, "Shard %i closed %i EpollConn nodes", sh->id, pcnt);
+
+    if (sh->durfd != -1) unwatchDurable(sh->durfd);
+    close(epfd);
+    return retstatus;
+}
+
+static void *epollShardMain(void *vself) {
+    EpollShard *sh = (EpollShard *)vself;
+    sh->status = runEpollShard(sh);
+
+    // Any shard failing takes the others down with it
+    uint64_t one = 1;
+    if (sh->status == -1 && write(sh->stopfd, &one, sizeof(one)) == -1)
+        logMsg(LOG_ERR, "ERROR in epollShardMain::write(%i): %m", sh->stopfd);
+    return vself;
+}
+
+// Runs one shard per listen socket in sfds: shard 0 on the calling
+// thread (which also owns sigfd and the timestamp timerfd tfd, -1 for
+// none), the rest on their own pinned threads. With nshards > 1 the
+// sockets are SO_REUSEPORT listeners on the same port, so the kernel
+// spreads new connections across them.
+int epollEventLoop(int *sfds, int nshards, const char *backend, int sigfd, int tfd) {
+    EpollShard *shards = NULL;
+    int stopfd = -1;
+    int retstatus = 0;
+    int err, nstarted = 1;
+
+    if (initSlab(&connSlab, "EpollConn", sizeof(EpollConn), 16, 0) == -1) return -1;
+
+    if ((stopfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1) {
+        logMsg(LOG_ERR, "ERROR in epollEventLoop::eventfd(2): %m");
+        return -1;
+    }
+    else if ((shards = (EpollShard *)calloc(nshards, sizeof(EpollShard))) == NULL) {
+        logMsg(LOG_ERR, "ERROR in epollEventLoop::calloc(3): %m");
+        close(stopfd);
+        return -1;
+    }
+
+    // Shards go to the CPUs this process may run on, round robin
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE], ncpus = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; c++)
+            if (CPU_ISSET(c, &allowed)) cpus[ncpus++] = c;
+    }
+    if (ncpus == 0) cpus[ncpus++] = 0;
+
+    for (int i = 0; i < nshards; i++) {
+        EpollShard *sh = &shards[i];
+        sh->id = i;
+        sh->nshards = nshards;
+        sh->cpu = cpus[i % ncpus];
+        sh->sfd = sfds[i];
+        sh->sigfd = i == 0 ? sigfd : -1;
+        sh->tfd = i == 0 ? tfd : -1;
+        sh->stopfd = stopfd;
+        sh->durfd = -1;
+        sh->backend = backend;
+    }
+
+    for (; nstarted < nshards; nstarted++) {
+        if ((err = pthread_create(&shards[nstarted].thread, NULL, epollShardMain, &shards[nstarted])) != 0) {
+            logMsg(LOG_ERR, "ERROR in epollEventLoop::pthread_create(3): %s", strerror(err));
+            retstatus = -1;
+            break;
+        }
+    }
+
+    if (retstatus == 0) retstatus = runEpollShard(&shards[0]);
+
+    // Stop the other shards (stopfd stays readable, each sees it once)
+    uint64_t one = 1;
+    if (write(stopfd, &one, sizeof(one)) == -1)
+        logMsg(LOG_ERR, "ERROR in epollEventLoop::write(%i): %m", stopfd);
+    for (int i = 1; i < nstarted; i++) {
+        if ((err = pthread_join(shards[i].thread, NULL)) != 0)
+            logMsg(LOG_ERR, "ERROR in epollEventLoop::pthread_join(3): %s", strerror(err));
+        else if (shards[i].status == -1) retstatus = -1;
+    }
+
+    logSlabStats(&connSlab);
+    destroySlab(&connSlab);
+    free(shards);
+    close(stopfd);
+    if (retstatus == 0) logMsg(LOG_DEBUG, "Caught signal, exiting");
+    return retstatus;
+}
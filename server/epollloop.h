@@ -0,0 +1,89 @@
+#ifndef EPOLLLOOP_H
+#define EPOLLLOOP_H
+
+#include "connthread.h"
+
+#include <sys/types.h>
+
+/*
+    Queued response: a History snapshot (usesnap), the backend
+    range [soff, send) or, when text is set, bytes [soff, send) of
+    that pooled block (stats report), each recording its own send
+    progress (started once any byte left or sits in sbuf). A backend
+    range holds retention from its first send on (hold, -1 for
+    none). In durable mode a data line's response is held until
+    BACKEND is durable up to its append end (durable, 0 = no wait).
+*/
+typedef struct {
+    int usesnap;
+    HistSnapshot snap;
+    size_t snapoff;
+    off_t soff, send;
+    int started;
+    long hold;
+    char *text;
+    size_t textsz;
+    off_t durable;
+} OutItem;
+
+/*
+    What to do with a client whose queued responses exceed the output
+    limit: close it, or keep only the latest N bytes of its newest
+    response (dropping older queued responses not yet in flight).
+*/
+typedef enum { LAG_DISCONNECT, LAG_TRUNCATE } LagPolicy;
+
+#define OUTQDEPTH 8
+
+/*
+    Per-connection state for the edge-triggered epoll engine.
+    A single thread multiplexes the listen socket, every client
+    socket and the signal sources. Each client socket is non-blocking.
+    Complete lines are processed as they arrive and their responses
+    queued in outq (a ring of OUTQDEPTH OutItems), which drains
+    whenever the socket is writable, so a client that reads slowly
+    can keep writing. Reading pauses only while outq is full.
+    Full-content responses are streamed from a History snapshot
+    when the mirror is warm. Otherwise regular file backends are sent
+    with sendfile(2), mapped content (mem store, segments, or a file
+    sendfile refuses) straight from the mapping and anything else
+    through sbuf. Wraps a ConnThread so the shared
+    backend helpers (writeFile, sendIoctl, ...) can be reused. Also
+    maintains prev/next pointers for use in Doubly Linked List.
+*/
+typedef struct EpollConn EpollConn;
+
+struct EpollConn {
+    ConnThread *ct;
+    LineBuffer line;
+    int eof;
+    int zerocopy;        // Backend is a regular file, use sendfile(2)
+
+    OutItem outq[OUTQDEPTH];
+    int qhead, qlen;
+
+    char sbuf[4096];     // Backend bytes of outq head read but not yet sent
+    size_t shead, stail;
+
+    EpollConn *prev, *next;
+};
+
+/*
+    One epoll event loop with its own listen socket sfd and
+    connections. Shard 0 also watches the signalfd and timestamp
+    timerfd and, on exit, tells the others to stop through the shared
+    stopfd eventfd. In durable mode durfd wakes the shard after every
+    group commit to release held responses.
+*/
+typedef struct {
+    int id, nshards, cpu;
+    int sfd, sigfd, tfd, stopfd, durfd;
+    const char *backend;
+    pthread_t thread;
+    int status;
+} EpollShard;
+
+void setOutputLimit(size_t maxbytes, LagPolicy policy);
+int epollEventLoop(int *sfds, int nshards, const char *backend, int sigfd, int tfd);
+
+#endif /* EPOLLLOOP_H */
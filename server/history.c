@@ -0,0 +1,214 @@
+#include "history.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define SENDIOV 16
+
+
+static HistChunk *newHistChunk() {
+    HistChunk *c = (HistChunk *)malloc(sizeof(HistChunk));
+    if (c == NULL) {
+        logMsg(LOG_ERR, "ERROR in newHistChunk::malloc(3): %m");
+        return NULL;
+    }
+
+    atomic_init(&c->refs, 1); // Held by predecessor (or History for head)
+    c->next = NULL;
+    return c;
+}
+
+// Drops one reference, freeing chunks down the chain that reach zero
+static void releaseChunk(HistChunk *c) {
+    while (c && atomic_fetch_sub(&c->refs, 1) == 1) {
+        HistChunk *nxt = c->next;
+        free(c);
+        c = nxt;
+    }
+}
+
+// Marks the mirror cold and drops its reference on the chain, so the
+// chunks go as soon as no snapshot holds them. Called with lock held.
+static void goCold(History *self) {
+    if (self->_cold) return;
+    self->_cold = 1;
+    releaseChunk(self->head);
+    self->head = self->tail = NULL;
+}
+
+// Loads current BACKEND content, up to maxsize bytes. Returns NULL when
+// backend is not a regular file (e.g. char device, which drops old
+// writes by itself).
+History *newHistory(const char *backend, size_t maxsize) {
+    struct stat st;
+    int found = stat(backend, &st) == 0;
+    if (found && !S_ISREG(st.st_mode)) {
+        logMsg(LOG_DEBUG, "No History mirror for non-regular backend %s", backend);
+        return NULL;
+    }
+
+    History *self = (History *)malloc(sizeof(History));
+    if (self == NULL) {
+        logMsg(LOG_ERR, "ERROR in newHistory::malloc(3): %m");
+        return NULL;
+    }
+    else if ((self->head = self->tail = newHistChunk()) == NULL) {
+        free(self);
+        return NULL;
+    }
+
+    pthread_mutex_init(&self->lock, NULL);
+    self->size = 0;
+    self->maxsize = maxsize;
+    self->_cold = 0;
+
+    int fd;
+    if (found && (size_t)st.st_size > maxsize) {
+        logMsg(LOG_INFO, "%s exceeds the History cap of %zu bytes, reading it directly", backend, maxsize);
+        goCold(self);
+    }
+    else if ((fd = open(backend, O_RDONLY)) != -1) {
+        char block[HISTCHUNKSZ];
+        ssize_t numRead;
+        while ((numRead = read(fd, block, sizeof(block))) != 0) {
+            if (numRead == -1 && errno == EINTR) continue;
+            else if (numRead == -1 || appendHistory(self, block, numRead) == -1) {
+                logMsg(LOG_ERR, "ERROR in newHistory: loading %s failed", backend);
+                goCold(self);
+                break;
+            }
+        }
+        close(fd);
+    }
+
+    logMsg(LOG_DEBUG, "Loaded %zu bytes of %s into History", self->size, backend);
+    return self;
+}
+
+int appendHistory(History *self, const char *data, size_t n) {
+    pthread_mutex_lock(&self->lock);
+
+    if (!self->_cold && self->size + n > self->maxsize) {
+        logMsg(LOG_INFO, "History reached its cap of %zu bytes, reading BACKEND directly", self->maxsize);
+        goCold(self);
+    }
+
+    while (n > 0 && !self->_cold) {
+        size_t used = self->size % HISTCHUNKSZ;
+        if (used == 0 && self->size > 0) {
+            HistChunk *c = newHistChunk();
+            if (c == NULL) {
+                goCold(self); // Mirror no longer matches BACKEND
+                break;
+            }
+            self->tail->next = c;
+            self->tail = c;
+        }
+
+        size_t ncopy = HISTCHUNKSZ - used;
+        if (ncopy > n) ncopy = n;
+        memcpy(&self->tail->data[used], data, ncopy);
+        self->size += ncopy;
+        data += ncopy;
+        n -= ncopy;
+    }
+
+    int status = self->_cold ? -1 : 0;
+    pthread_mutex_unlock(&self->lock);
+    return status;
+}
+
+void markHistoryCold(History *self) {
+    pthread_mutex_lock(&self->lock);
+    goCold(self);
+    pthread_mutex_unlock(&self->lock);
+}
+
+int takeSnapshot(History *self, HistSnapshot *snap) {
+    pthread_mutex_lock(&self->lock);
+    int status = self->_cold ? -1 : 0;
+    if (status == 0) {
+        atomic_fetch_add(&self->head->refs, 1);
+        snap->first = snap->cur = self->head;
+        snap->len = self->size;
+        snap->curbase = 0;
+    }
+    pthread_mutex_unlock(&self->lock);
+    return status;
+}
+
+void releaseSnapshot(HistSnapshot *snap) {
+    releaseChunk(snap->first);
+    snap->first = snap->cur = NULL;
+    snap->len = snap->curbase = 0;
+}
+
+// Fills up to maxiov iovecs covering snapshot bytes from off onwards.
+// Returns the number of iovecs used (0 once off reaches the end).
+int snapshotIov(HistSnapshot *snap, size_t off, struct iovec *iov, int maxiov) {
+    int niov = 0;
+
+    // Advance to chunk holding off from where the last call started
+    // (from the first chunk if off moved back); all chunks before tail are full
+    if (off < snap->curbase) {
+        snap->cur = snap->first;
+        snap->curbase = 0;
+    }
+    while (off - snap->curbase >= HISTCHUNKSZ && off < snap->len) {
+        snap->cur = snap->cur->next;
+        snap->curbase += HISTCHUNKSZ;
+    }
+    HistChunk *c = snap->cur;
+
+    while (niov < maxiov && off < snap->len) {
+        size_t coff = off % HISTCHUNKSZ;
+        size_t n = HISTCHUNKSZ - coff;
+        if (n > snap->len - off) n = snap->len - off;
+        iov[niov].iov_base = &c->data[coff];
+        iov[niov].iov_len = n;
+        niov += 1;
+        off += n;
+
+        // Only follow next when snapshot covers it (tail may be growing)
+        if (off < snap->len) c = c->next;
+    }
+    return niov;
+}
+
+// Sends snapshot bytes from *off until done or sendmsg(2) fails,
+// advancing *off. Returns bytes sent, or -1 on ERROR (errno preserved,
+// e.g. EAGAIN on a non-blocking socket) with *off still advanced.
+ssize_t sendSnapshot(HistSnapshot *snap, size_t *off, int cfd, int flags) {
+    ssize_t totalSent = 0;
+
+    while (*off < snap->len) {
+        struct iovec iov[SENDIOV];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = snapshotIov(snap, *off, iov, SENDIOV);
+
+        ssize_t numSent = sendmsg(cfd, &msg, flags | MSG_NOSIGNAL);
+        if (numSent == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        *off += numSent;
+        totalSent += numSent;
+    }
+
+    return totalSent;
+}
+
+void destroyHistory(History *self) {
+    releaseChunk(self->head);
+    pthread_mutex_destroy(&self->lock);
+    free(self);
+}
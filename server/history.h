@@ -0,0 +1,65 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define HISTCHUNKSZ 65536
+#define HISTMAXSZ ((size_t)64 << 20) // Default mirror cap (-H)
+
+/*
+    Fixed-size block of History content. Every chunk but the tail
+    is full, and bytes below the published History size are never
+    rewritten. Each chunk holds a reference on its successor, so a
+    reference on one chunk keeps the rest of the chain alive.
+*/
+typedef struct HistChunk HistChunk;
+
+struct HistChunk {
+    atomic_int refs;
+    HistChunk *next;
+    char data[HISTCHUNKSZ];
+};
+
+/*
+    Immutable view of the first len bytes of a History. Holds a
+    reference on its first chunk, so it stays valid while appends
+    continue. Call releaseSnapshot() when done. cur is the chunk the
+    last snapshotIov() started in (at offset curbase), so sending a
+    snapshot front to back walks the chain once.
+*/
+typedef struct {
+    HistChunk *first;
+    size_t len;
+    HistChunk *cur;
+    size_t curbase;
+} HistSnapshot;
+
+/*
+    Append-only, reference-counted in-memory mirror of a regular file
+    BACKEND, kept in sync by the write path so responses can be served
+    from a snapshot without re-reading BACKEND. Only appendHistory()
+    and takeSnapshot() take the (short) lock. If an append fails, or
+    would grow the mirror past maxsize bytes, the mirror goes _cold:
+    its chunks are freed once the last snapshot is released, and
+    callers must fall back to reading BACKEND from then on.
+*/
+typedef struct {
+    pthread_mutex_t lock;
+    HistChunk *head, *tail;
+    size_t size, maxsize;
+    int _cold;
+} History;
+
+History *newHistory(const char *backend, size_t maxsize);
+int appendHistory(History *self, const char *data, size_t n);
+void markHistoryCold(History *self);
+int takeSnapshot(History *self, HistSnapshot *snap);
+void releaseSnapshot(HistSnapshot *snap);
+int snapshotIov(HistSnapshot *snap, size_t off, struct iovec *iov, int maxiov);
+ssize_t sendSnapshot(HistSnapshot *snap, size_t *off, int cfd, int flags);
+void destroyHistory(History *self);
+
+#endif /* HISTORY_H */
@@ -0,0 +1,223 @@
+#include "logger.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define FLUSHMS 50 // Flusher wakeup interval when no ring fills up
+
+typedef struct {
+    int level;
+    char msg[LOGMSGSZ];
+} LogEntry;
+
+typedef struct LogRing LogRing;
+
+struct LogRing {
+    atomic_uint head;         // Next entry the owning thread fills
+    atomic_uint tail;         // Next entry the flusher sends
+    atomic_ulong dropped;     // Messages lost to a full ring (owner writes)
+    unsigned long reported;   // Drops already reported (flusher only)
+    atomic_int dead;          // Owner exited, recycle once drained
+    LogRing *next;
+    LogEntry entries[LOGRINGSZ];
+};
+
+int logLevel = LOG_DEBUG;
+
+static atomic_int running;
+static pthread_t flusher;
+static int wakefd = -1;
+
+// Rings claimed since the last flush (lock-free push, the flusher
+// takes them all), rings the flusher drains, and recycled rings
+static _Atomic(LogRing *) newRings = NULL;
+static LogRing *rings = NULL;
+static LogRing *freeRings = NULL;
+static pthread_mutex_t freeLock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread LogRing *local = NULL;
+static pthread_key_t ringKey;
+static pthread_once_t ringOnce = PTHREAD_ONCE_INIT;
+
+static const char *levelNames[] = {
+    "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+};
+
+
+// Hands an exiting thread's ring back, the flusher drains and recycles it
+static void releaseRing(void *vring) {
+    atomic_store_explicit(&((LogRing *)vring)->dead, 1, memory_order_release);
+    local = NULL;
+}
+
+static void createRingKey() {
+    pthread_key_create(&ringKey, releaseRing);
+}
+
+// Claims a ring for the calling thread on its first message
+static LogRing *localRing() {
+    if (local) return local;
+    pthread_once(&ringOnce, createRingKey);
+
+    pthread_mutex_lock(&freeLock);
+    LogRing *r = freeRings;
+    if (r) freeRings = r->next;
+    pthread_mutex_unlock(&freeLock);
+    if (r == NULL && (r = (LogRing *)malloc(sizeof(LogRing))) == NULL) return NULL;
+
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->dropped, 0);
+    atomic_init(&r->dead, 0);
+    r->reported = 0;
+
+    LogRing *top = atomic_load(&newRings);
+    do r->next = top;
+    while (!atomic_compare_exchange_weak(&newRings, &top, r));
+
+    pthread_setspecific(ringKey, r);
+    return local = r;
+}
+
+// EAGAIN means a wakeup is already pending
+static int wakeFlusher() {
+    uint64_t one = 1;
+    return write(wakefd, &one, sizeof(one)) == -1 && errno != EAGAIN ? -1 : 0;
+}
+
+void logWrite(int level, const char *fmt, ...) {
+    int err = errno; // For %m, claiming a ring may clobber it
+    va_list ap;
+    va_start(ap, fmt);
+
+    LogRing *r = atomic_load_explicit(&running, memory_order_acquire) ? localRing() : NULL;
+    errno = err;
+    if (r == NULL) vsyslog(level, fmt, ap);
+    else {
+        unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        unsigned int used = head - atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (used == LOGRINGSZ) {
+            unsigned long n = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+            atomic_store_explicit(&r->dropped, n + 1, memory_order_relaxed);
+        }
+        else {
+            LogEntry *e = &r->entries[head & (LOGRINGSZ - 1)];
+            e->level = level;
+            vsnprintf(e->msg, LOGMSGSZ, fmt, ap);
+            atomic_store_explicit(&r->head, head + 1, memory_order_release);
+
+            // Wake the flusher early once, as the ring reaches half full
+            if (used + 1 == LOGRINGSZ / 2) wakeFlusher();
+        }
+    }
+
+    va_end(ap);
+    errno = err;
+}
+
+// Sends every queued message to syslog, then recycles the rings of
+// threads that have exited
+static void drainRings() {
+    LogRing *fresh = atomic_exchange(&newRings, NULL);
+    while (fresh) {
+        LogRing *nxt = fresh->next;
+        fresh->next = rings;
+        rings = fresh;
+        fresh = nxt;
+    }
+
+    LogRing *r, **pr = &rings;
+    while ((r = *pr)) {
+        // Read dead first: messages written before it was set are then visible
+        int dead = atomic_load_explicit(&r->dead, memory_order_acquire);
+        unsigned int head = atomic_load_explicit(&r->head, memory_order_acquire);
+        unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        for (; tail != head; tail++) {
+            LogEntry *e = &r->entries[tail & (LOGRINGSZ - 1)];
+            syslog(e->level, "%s", e->msg);
+            atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+        }
+
+        unsigned long dropped = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+        if (dropped != r->reported) {
+            syslog(LOG_WARNING, "Dropped %lu log messages (thread ring full)", dropped - r->reported);
+            r->reported = dropped;
+        }
+
+        if (!dead) {
+            pr = &r->next;
+            continue;
+        }
+        *pr = r->next;
+        pthread_mutex_lock(&freeLock);
+        r->next = freeRings;
+        freeRings = r;
+        pthread_mutex_unlock(&freeLock);
+    }
+}
+
+static void *flusherMain(void *unused) {
+    struct pollfd pfd = { .fd = wakefd, .events = POLLIN };
+    uint64_t n;
+    (void)unused;
+
+    while (atomic_load(&running)) {
+        if (poll(&pfd, 1, FLUSHMS) == 1 && read(wakefd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+            syslog(LOG_ERR, "ERROR in flusherMain::read(%i): %m", wakefd);
+        drainRings();
+    }
+    drainRings();
+    return NULL;
+}
+
+// Maps a -L argument (syslog level name or number) to its level.
+// Returns -1 if unknown.
+int parseLogLevel(const char *name, int *level) {
+    for (int i = LOG_EMERG; i <= LOG_DEBUG; i++) {
+        if (strcmp(name, levelNames[i]) == 0 || (name[0] == '0' + i && name[1] == '\0')) {
+            *level = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Starts the flusher thread, call after any fork (threads do not survive it)
+int startLogging() {
+    int err;
+
+    if ((wakefd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1) {
+        syslog(LOG_ERR, "ERROR in startLogging::eventfd(2): %m");
+        return -1;
+    }
+    atomic_store(&running, 1);
+    if ((err = pthread_create(&flusher, NULL, flusherMain, NULL)) != 0) {
+        atomic_store(&running, 0);
+        syslog(LOG_ERR, "ERROR in startLogging::pthread_create(3): %s", strerror(err));
+        close(wakefd);
+        wakefd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Flushes what is queued and stops the flusher, later messages are
+// logged synchronously. Call once other threads have stopped logging.
+void stopLogging() {
+    if (!atomic_load(&running)) return;
+    atomic_store(&running, 0);
+    if (wakeFlusher() == -1)
+        syslog(LOG_ERR, "ERROR in stopLogging::write(%i): %m", wakefd);
+    pthread_join(flusher, NULL);
+    close(wakefd);
+    wakefd = -1;
+}
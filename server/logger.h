@@ -0,0 +1,38 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <syslog.h>
+
+/*
+    Highest syslog priority compiled in, e.g. -DLOGLEVELMAX=LOG_INFO
+    drops every LOG_DEBUG call site from the binary.
+*/
+#ifndef LOGLEVELMAX
+#define LOGLEVELMAX LOG_DEBUG
+#endif
+
+#define LOGRINGSZ 256  // Messages per thread ring (power of two)
+#define LOGMSGSZ 192   // Longer messages are truncated
+
+/*
+    Level-gated asynchronous syslog. logMsg() takes syslog(3) arguments
+    (%m included); levels above LOGLEVELMAX or the runtime logLevel
+    (-L) cost one branch. Enabled messages are formatted into the
+    calling thread's single-producer ring and sent to syslog by a
+    flusher thread, so callers never block on syslog or allocate (past
+    their first message, which claims a ring). A full ring drops the
+    message and counts it; the flusher reports drops. Before
+    startLogging() and after stopLogging(), messages go straight to
+    syslog.
+*/
+extern int logLevel;
+
+#define logMsg(level, ...) \
+    do { if ((level) <= LOGLEVELMAX && (level) <= logLevel) logWrite((level), __VA_ARGS__); } while (0)
+
+void logWrite(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int parseLogLevel(const char *name, int *level);
+int startLogging();
+void stopLogging();
+
+#endif /* LOGGER_H */
@@ -0,0 +1,202 @@
+#include "metrics.h"
+#include "logger.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *counterNames[NCOUNTERS] = {
+    "lines_received_total", "bytes_appended_total", "bytes_sent_total",
+    "connections_accepted_total", "connections_closed_total",
+    "fdatasync_total", "durable_appends_total",
+    "segment_raw_bytes_total", "segment_packed_bytes_total"
+};
+static const char *histNames[NHISTS] = {
+    "append_lock_wait_ns", "write_ns", "send_ns", "fdatasync_ns", "segment_pack_ns"
+};
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+// Live per-thread blocks, totals of exited threads and recycled blocks
+static pthread_mutex_t metricsLock = PTHREAD_MUTEX_INITIALIZER;
+static ThreadMetrics *live = NULL;
+static ThreadMetrics *freeBlocks = NULL;
+static ThreadMetrics retired;
+static uint64_t startNs = 0;
+static uint64_t lastRateNs = 0, lastRateAccepted = 0;
+
+static __thread ThreadMetrics *local = NULL;
+static pthread_key_t metricsKey;
+static pthread_once_t metricsOnce = PTHREAD_ONCE_INIT;
+
+
+// Adds v to a single-writer counter without a locked instruction
+static inline void bump(_Atomic uint64_t *c, uint64_t v) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+static void mergeInto(ThreadMetrics *dst, ThreadMetrics *src) {
+    for (int i = 0; i < NCOUNTERS; i++) bump(&dst->counters[i], atomic_load(&src->counters[i]));
+    for (int h = 0; h < NHISTS; h++) {
+        for (int b = 0; b < HISTBUCKETS; b++) {
+            uint64_t n = atomic_load_explicit(&src->hist[h][b], memory_order_relaxed);
+            if (n) bump(&dst->hist[h][b], n);
+        }
+        bump(&dst->histsum[h], atomic_load(&src->histsum[h]));
+        if (atomic_load(&src->histmax[h]) > atomic_load(&dst->histmax[h]))
+            atomic_store(&dst->histmax[h], atomic_load(&src->histmax[h]));
+    }
+}
+
+// Folds an exiting thread's block into retired and recycles it
+static void retireMetrics(void *vblock) {
+    ThreadMetrics *m = (ThreadMetrics *)vblock;
+
+    pthread_mutex_lock(&metricsLock);
+    mergeInto(&retired, m);
+    if (m->prev) m->prev->next = m->next;
+    else live = m->next;
+    if (m->next) m->next->prev = m->prev;
+    m->next = freeBlocks;
+    freeBlocks = m;
+    pthread_mutex_unlock(&metricsLock);
+    local = NULL;
+}
+
+static void createMetricsKey() {
+    pthread_key_create(&metricsKey, retireMetrics);
+}
+
+// Registers a (zeroed) block for the calling thread on its first event
+static ThreadMetrics *localMetrics() {
+    if (local) return local;
+    pthread_once(&metricsOnce, createMetricsKey);
+
+    pthread_mutex_lock(&metricsLock);
+    ThreadMetrics *m = freeBlocks;
+    if (m) freeBlocks = m->next;
+    else if ((m = (ThreadMetrics *)malloc(sizeof(ThreadMetrics))) == NULL) {
+        pthread_mutex_unlock(&metricsLock);
+        logMsg(LOG_ERR, "ERROR in localMetrics::malloc(3): %m");
+        return NULL;
+    }
+    memset(m, 0, sizeof(ThreadMetrics));
+    m->next = live;
+    if (live) live->prev = m;
+    live = m;
+    pthread_mutex_unlock(&metricsLock);
+
+    pthread_setspecific(metricsKey, m);
+    return local = m;
+}
+
+uint64_t metricsClock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void initMetrics() {
+    pthread_once(&metricsOnce, createMetricsKey);
+    startNs = lastRateNs = metricsClock();
+}
+
+void countMetric(MetricCounter c, uint64_t n) {
+    ThreadMetrics *m = localMetrics();
+    if (m) bump(&m->counters[c], n);
+}
+
+static int bucketOf(uint64_t v) {
+    if (v < HISTSUB) return v;
+
+    int msb = 63 - __builtin_clzll(v);
+    if (msb >= HISTMAXBIT) return HISTBUCKETS - 1;
+    return (msb - 3) * HISTSUB + ((v >> (msb - 4)) & (HISTSUB - 1));
+}
+
+// Midpoint of the values falling in bucket b
+static uint64_t bucketValue(int b) {
+    if (b < HISTSUB) return b;
+
+    int shift = b / HISTSUB - 1;
+    uint64_t lower = (uint64_t)(HISTSUB + b % HISTSUB) << shift;
+    return lower + ((1ull << shift) >> 1);
+}
+
+void recordLatency(MetricHist h, uint64_t ns) {
+    ThreadMetrics *m = localMetrics();
+    if (m == NULL) return;
+
+    bump(&m->hist[h][bucketOf(ns)], 1);
+    bump(&m->histsum[h], ns);
+    if (ns > atomic_load_explicit(&m->histmax[h], memory_order_relaxed))
+        atomic_store_explicit(&m->histmax[h], ns, memory_order_relaxed);
+}
+
+// Appends printf output at *off, failing once buf is full
+static int put(char *buf, size_t bufsz, size_t *off, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static int put(char *buf, size_t bufsz, size_t *off, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + *off, bufsz - *off, fmt, ap);
+    va_end(ap);
+
+    if (n < 0 || (size_t)n >= bufsz - *off) return -1;
+    *off += n;
+    return 0;
+}
+
+// Writes every metric as a "name value" line (Prometheus text format)
+// into buf. Returns the text length, or -1 if bufsz is too small.
+ssize_t formatStats(char *buf, size_t bufsz) {
+    ThreadMetrics *sum = (ThreadMetrics *)calloc(1, sizeof(ThreadMetrics));
+    if (sum == NULL) {
+        logMsg(LOG_ERR, "ERROR in formatStats::calloc(3): %m");
+        return -1;
+    }
+
+    pthread_mutex_lock(&metricsLock);
+    mergeInto(sum, &retired);
+    for (ThreadMetrics *m = live; m; m = m->next) mergeInto(sum, m);
+
+    // Accept rate over the interval since the previous stats request
+    uint64_t now = metricsClock();
+    uint64_t accepted = atomic_load(&sum->counters[M_ACCEPTED]);
+    double rate = now > lastRateNs ? (accepted - lastRateAccepted) * 1e9 / (now - lastRateNs) : 0.0;
+    lastRateNs = now;
+    lastRateAccepted = accepted;
+    pthread_mutex_unlock(&metricsLock);
+
+    size_t off = 0;
+    int rc = put(buf, bufsz, &off, "uptime_seconds %.3f\n", (now - startNs) / 1e9);
+    for (int i = 0; i < NCOUNTERS && rc == 0; i++)
+        rc = put(buf, bufsz, &off, "%s %" PRIu64 "\n", counterNames[i], atomic_load(&sum->counters[i]));
+    if (rc == 0) rc = put(buf, bufsz, &off, "connections_active %ld\n",
+        (long)(accepted - atomic_load(&sum->counters[M_CLOSED])));
+    if (rc == 0) rc = put(buf, bufsz, &off, "accept_rate_per_second %.1f\n", rate);
+
+    for (int h = 0; h < NHISTS && rc == 0; h++) {
+        uint64_t count = 0, seen = 0;
+        for (int b = 0; b < HISTBUCKETS; b++) count += atomic_load(&sum->hist[h][b]);
+
+        rc = put(buf, bufsz, &off, "%s_count %" PRIu64 "\n%s_sum %" PRIu64 "\n", histNames[h], count,
+            histNames[h], atomic_load(&sum->histsum[h]));
+        // Quantiles ascend, so one pass over the buckets finds them all
+        for (size_t q = 0, b = 0; q < sizeof(quantiles) / sizeof(quantiles[0]) && rc == 0; q++) {
+            uint64_t rank = count - (uint64_t)((1.0 - quantiles[q]) * count);
+            while (b < HISTBUCKETS - 1 && seen + atomic_load(&sum->hist[h][b]) < rank)
+                seen += atomic_load(&sum->hist[h][b++]);
+            rc = put(buf, bufsz, &off, "%s{quantile=\"%g\"} %" PRIu64 "\n", histNames[h], quantiles[q],
+                count ? bucketValue(b) : 0);
+        }
+        if (rc == 0) rc = put(buf, bufsz, &off, "%s_max %" PRIu64 "\n", histNames[h], atomic_load(&sum->histmax[h]));
+    }
+
+    free(sum);
+    return rc == 0 ? (ssize_t)off : -1;
+}
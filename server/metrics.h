@@ -0,0 +1,72 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+    Monotonic event counters. Connections active is derived as
+    accepted - closed, so each is only ever incremented.
+*/
+typedef enum {
+    M_LINES,          // Lines received (data and control)
+    M_APPENDED,       // Bytes appended to BACKEND
+    M_SENT,           // Response bytes sent to clients
+    M_ACCEPTED,       // Connections accepted
+    M_CLOSED,         // Connections closed
+    M_SYNCS,          // Group commit flushes (-D)
+    M_DURABLE,        // Appends awaiting them
+    M_PACKIN,         // Sealed segment bytes compressed (-Z)
+    M_PACKOUT,        // Bytes they take compressed
+    NCOUNTERS
+} MetricCounter;
+
+/*
+    Latency histograms, recorded in nanoseconds.
+*/
+typedef enum {
+    H_LOCKWAIT,       // Waiting to acquire appendLock
+    H_WRITE,          // writeFile(): reserve, write and publish one append
+    H_SEND,           // Sending one response (or one non-blocking attempt)
+    H_SYNC,           // One group commit flush (fdatasync)
+    H_PACK,           // Compressing one sealed segment
+    NHISTS
+} MetricHist;
+
+/*
+    HDR-style log-linear buckets: values below HISTSUB ns get a bucket
+    each, above that every power of two is split into HISTSUB linear
+    sub-buckets (~6% relative error). Values past 2^HISTMAXBIT ns
+    (~69 s) are clamped into the last bucket.
+*/
+#define HISTSUB 16
+#define HISTMAXBIT 36
+#define HISTBUCKETS ((HISTMAXBIT - 3) * HISTSUB)
+
+/*
+    Per-thread metrics block. Only its own thread writes it (plain
+    relaxed load + store, no locked instructions on the hot path);
+    formatStats() sums every live block plus the totals folded in
+    from exited threads, so reads may lag writes by a few events.
+*/
+typedef struct ThreadMetrics ThreadMetrics;
+
+struct ThreadMetrics {
+    _Atomic uint64_t counters[NCOUNTERS];
+    _Atomic uint64_t hist[NHISTS][HISTBUCKETS];
+    _Atomic uint64_t histsum[NHISTS];
+    _Atomic uint64_t histmax[NHISTS];
+    ThreadMetrics *prev, *next;
+};
+
+#define STATSBUFSZ 4096
+
+void initMetrics();
+uint64_t metricsClock();
+void countMetric(MetricCounter c, uint64_t n);
+void recordLatency(MetricHist h, uint64_t ns);
+ssize_t formatStats(char *buf, size_t bufsz);
+
+#endif /* METRICS_H */
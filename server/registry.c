@@ -0,0 +1,114 @@
+#include "registry.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+
+int initRegistry(ConnRegistry *self) {
+    self->head = NULL;
+    self->count = 0;
+    atomic_init(&self->done, NULL);
+    pthread_mutex_init(&self->fdLock, NULL);
+    if ((self->efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1) {
+        logMsg(LOG_ERR, "ERROR in initRegistry::eventfd(2): %m");
+        return -1;
+    }
+    return 0;
+}
+
+void registerConn(ConnRegistry *self, ConnThread *ct) {
+    ct->registry = self;
+    ct->prev = NULL;
+    ct->next = self->head;
+    if (self->head) self->head->prev = ct;
+    self->head = ct;
+    self->count += 1;
+}
+
+void unregisterConn(ConnRegistry *self, ConnThread *ct) {
+    if (ct->prev) ct->prev->next = ct->next;
+    else self->head = ct->next;
+    if (ct->next) ct->next->prev = ct->prev;
+    ct->prev = ct->next = NULL;
+    self->count -= 1;
+}
+
+// Closes a finishing connection's socket, hidden from termAllConns() first
+void closeConnFd(ConnRegistry *self, ConnThread *ct) {
+    pthread_mutex_lock(&self->fdLock);
+    int cfd = ct->cfd;
+    ct->cfd = -1;
+    pthread_mutex_unlock(&self->fdLock);
+    close(cfd);
+}
+
+// Called by a finishing connection thread as its last access to ct
+void completeConn(ConnRegistry *self, ConnThread *ct) {
+    ConnThread *top = atomic_load(&self->done);
+    do ct->doneNext = top;
+    while (!atomic_compare_exchange_weak(&self->done, &top, ct));
+
+    uint64_t one = 1;
+    if (write(self->efd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        logMsg(LOG_ERR, "ERROR in completeConn::write(%i): %m", self->efd);
+}
+
+// Joins, unregisters and frees every finished connection.
+// Returns number of connections reaped.
+int reapDoneConns(ConnRegistry *self) {
+    uint64_t n;
+    int err, pcnt = 0;
+
+    // Reset eventfd before draining so a later completion re-arms it
+    if (read(self->efd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+        logMsg(LOG_ERR, "ERROR in reapDoneConns::read(%i): %m", self->efd);
+
+    ConnThread *ct = atomic_exchange(&self->done, NULL);
+    while (ct) {
+        ConnThread *nxt = ct->doneNext;
+        logMsg(LOG_DEBUG, "Joining thread %i in reapDoneConns", ct->tid);
+        if ((err = pthread_join(ct->thread, NULL)) != 0)
+            logMsg(LOG_ERR, "ERROR in reapDoneConns::pthread_join(3): %s", strerror(err));
+
+        unregisterConn(self, ct);
+        freeConnThread(ct);
+        ct = nxt;
+        pcnt += 1;
+    }
+
+    if (pcnt) logMsg(LOG_DEBUG, "Reaped %i ConnThread nodes (%zu live)", pcnt, self->count);
+    return pcnt;
+}
+
+// Asks every live connection to exit, unblocking its socket I/O,
+// then reaps them all
+void termAllConns(ConnRegistry *self) {
+    int pcnt = 0;
+
+    pthread_mutex_lock(&self->fdLock);
+    for (ConnThread *ct = self->head; ct; ct = ct->next) {
+        ct->_exitflag = 1;
+        if (ct->cfd != -1) shutdown(ct->cfd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&self->fdLock);
+
+    struct pollfd pfd = { .fd = self->efd, .events = POLLIN };
+    while (self->head) {
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            logMsg(LOG_ERR, "ERROR in termAllConns::poll(2): %m");
+            break;
+        }
+        pcnt += reapDoneConns(self);
+    }
+
+    logMsg(LOG_DEBUG, "Terminated %i ConnThread nodes", pcnt);
+}
+
+void destroyRegistry(ConnRegistry *self) {
+    if (self->efd != -1) close(self->efd);
+    self->efd = -1;
+    pthread_mutex_destroy(&self->fdLock);
+}
@@ -0,0 +1,37 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include "connthread.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+    Registry of live thread-per-connection ConnThreads. Nodes are
+    linked intrusively through ConnThread prev/next, so registering
+    and unregistering are O(1). Only the main thread touches the
+    list. A finishing thread pushes itself on the lock-free done
+    stack and signals efd (an eventfd), so the main loop can select(2)
+    on efd and join/free finished connections as soon as they exit.
+    fdLock pairs a thread closing its socket (cfd set to -1 first) with
+    termAllConns() shutting live sockets down, so shutdown never hits
+    an fd number already closed and reused.
+*/
+struct ConnRegistry {
+    ConnThread *head;
+    size_t count;
+    int efd;
+    _Atomic(ConnThread *) done;
+    pthread_mutex_t fdLock;
+};
+
+int initRegistry(ConnRegistry *self);
+void registerConn(ConnRegistry *self, ConnThread *ct);
+void unregisterConn(ConnRegistry *self, ConnThread *ct);
+void closeConnFd(ConnRegistry *self, ConnThread *ct);
+void completeConn(ConnRegistry *self, ConnThread *ct);
+int reapDoneConns(ConnRegistry *self);
+void termAllConns(ConnRegistry *self);
+void destroyRegistry(ConnRegistry *self);
+
+#endif /* REGISTRY_H */
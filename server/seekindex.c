@@ -0,0 +1,209 @@
+#include "seekindex.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SCANBLK ((size_t)1 << 20)
+
+
+static void indexPath(char *buf, size_t bufsz, const char *path) {
+    snprintf(buf, bufsz, "%s%s", path, IDXSUFFIX);
+}
+
+// Adds the end of one write command (call with lock held exclusively)
+static int pushEnd(SeekIndex *self, off_t end) {
+    if (self->n == self->cap) {
+        // Commands below the retained window are dropped before growing
+        if (self->lo > self->n / 2 && self->fd == -1) {
+            memmove(self->ends, &self->ends[self->lo], (self->n - self->lo) * sizeof(off_t));
+            self->n -= self->lo;
+            self->lo = 0;
+        }
+        else {
+            size_t cap = self->cap ? self->cap * 2 : 4096;
+            off_t *ends = (off_t *)realloc(self->ends, cap * sizeof(off_t));
+            if (ends == NULL) return -1;
+            self->ends = ends;
+            self->cap = cap;
+        }
+    }
+    self->ends[self->n++] = end;
+    return 0;
+}
+
+// Indexes every '\n' in data, which sits at BACKEND offset off
+static int scanEnds(SeekIndex *self, const char *data, size_t n, off_t off) {
+    for (const char *p = data, *eol; (eol = memchr(p, '\n', data + n - p)); p = eol + 1) {
+        if (pushEnd(self, off + (eol - data) + 1) == -1) return -1;
+    }
+    return 0;
+}
+
+// Writes the entries not yet in the index file
+static void persistEnds(SeekIndex *self) {
+    size_t count = self->n - self->npersisted;
+    const char *buf = (const char *)&self->ends[self->npersisted];
+    off_t off = self->npersisted * sizeof(off_t);
+    size_t numWrite = 0;
+
+    while (numWrite < count * sizeof(off_t)) {
+        ssize_t nw = pwrite(self->fd, buf + numWrite, count * sizeof(off_t) - numWrite, off + numWrite);
+        if (nw == -1 && errno == EINTR) continue;
+        else if (nw <= 0) {
+            logMsg(LOG_ERR, "ERROR in persistEnds::pwrite(%i): %m", self->fd);
+            return;
+        }
+        numWrite += nw;
+    }
+    self->npersisted = self->n;
+}
+
+// Loads a persisted index that matches BACKEND up to end. Returns the
+// offset to rescan from (past the last loaded entry).
+static off_t loadEnds(SeekIndex *self, off_t base, off_t end) {
+    struct stat st;
+    char last;
+
+    if (fstat(self->fd, &st) == -1 || st.st_size == 0) return base;
+    size_t count = st.st_size / sizeof(off_t);
+    if (st.st_size % sizeof(off_t) == 0 && (self->ends = (off_t *)malloc(st.st_size)) != NULL) {
+        self->cap = count;
+        if (pread(self->fd, self->ends, st.st_size, 0) == st.st_size) self->n = count;
+    }
+
+    // Entries must increase within [base, end] and each end a line
+    for (size_t i = 0; i < self->n; i++) {
+        off_t prev = i ? self->ends[i - 1] : base;
+        if (self->ends[i] <= prev || self->ends[i] > end) self->n = 0;
+    }
+    if (self->n && (self->store->ops->read(self->store, &last, 1, self->ends[self->n - 1] - 1) != 1 || last != '\n'))
+        self->n = 0;
+
+    if (self->n == 0 && ftruncate(self->fd, 0) == -1)
+        logMsg(LOG_ERR, "ERROR in loadEnds::ftruncate(%i): %m", self->fd);
+    self->npersisted = self->n;
+    return self->n ? self->ends[self->n - 1] : base;
+}
+
+// Builds the index of store, loading path.idx if valid (path NULL for
+// an in-memory index), then scanning whatever BACKEND holds past it
+SeekIndex *newSeekIndex(Backend *store, const char *path) {
+    char name[PATH_MAX];
+    off_t base = atomic_load(&store->base);
+    off_t end = store->ops->size(store);
+
+    if (end == -1) {
+        logMsg(LOG_ERR, "ERROR in newSeekIndex::size(%s): %m", store->path);
+        return NULL;
+    }
+
+    SeekIndex *self = (SeekIndex *)calloc(1, sizeof(SeekIndex));
+    char *block = (char *)malloc(SCANBLK);
+    if (self == NULL || block == NULL) {
+        logMsg(LOG_ERR, "ERROR in newSeekIndex::malloc(3): %m");
+        free(self);
+        free(block);
+        return NULL;
+    }
+
+    pthread_rwlock_init(&self->lock, NULL);
+    self->store = store;
+    self->fd = -1;
+
+    off_t off = base;
+    if (path) {
+        indexPath(name, sizeof(name), path);
+        if ((self->fd = open(name, O_CREAT|O_RDWR|O_CLOEXEC, 0644)) == -1)
+            logMsg(LOG_ERR, "ERROR in newSeekIndex::open(%s) %m", name);
+        else off = loadEnds(self, base, end);
+    }
+    size_t nloaded = self->n;
+
+    while (off < end) {
+        size_t want = (end - off) < (off_t)SCANBLK ? (size_t)(end - off) : SCANBLK;
+        ssize_t numRead = store->ops->read(store, block, want, off);
+        if (numRead <= 0 || scanEnds(self, block, numRead, off) == -1) {
+            logMsg(LOG_ERR, "ERROR in newSeekIndex::read(%s): %m", store->path);
+            self->_cold = 1;
+            break;
+        }
+        off += numRead;
+    }
+    free(block);
+
+    if (self->fd != -1) persistEnds(self);
+    logMsg(LOG_DEBUG, "Indexed %zu write commands of %s (%zu loaded)", self->n, store->path, nloaded);
+    return self;
+}
+
+// Indexes a published append of n bytes at off (call under appendLock,
+// in offset order)
+int indexAppend(SeekIndex *self, const char *data, size_t n, off_t off) {
+    off_t base = atomic_load(&self->store->base);
+    int rc = 0;
+
+    pthread_rwlock_wrlock(&self->lock);
+    while (self->lo < self->n && self->ends[self->lo] <= base) self->lo += 1;
+    if (!self->_cold && scanEnds(self, data, n, off) == -1) {
+        logMsg(LOG_ERR, "ERROR in indexAppend::realloc(3): %m");
+        self->_cold = 1;
+        rc = -1;
+    }
+    if (self->fd != -1 && self->n - self->npersisted >= IDXFLUSH) persistEnds(self);
+    pthread_rwlock_unlock(&self->lock);
+    return rc;
+}
+
+// Offset of the seekto->write_cmd'th command (counted from the retained
+// base) plus write_cmd_offset, within the first end bytes. -1 with
+// errno EINVAL when out of range.
+off_t indexSeekto(SeekIndex *self, const struct aesd_seekto *seekto, off_t end) {
+    Backend *store = self->store;
+    off_t base = atomic_load(&store->base);
+    off_t pos = -1;
+
+    pthread_rwlock_rdlock(&self->lock);
+    if (self->_cold) {
+        pthread_rwlock_unlock(&self->lock);
+        return store->ops->seekto(store, seekto, end);
+    }
+
+    // Retention may have moved base since the last append
+    size_t lo = self->lo;
+    while (lo < self->n && self->ends[lo] <= base) lo += 1;
+
+    size_t i = lo + seekto->write_cmd;
+    if (seekto->write_cmd == 0 || i - 1 < self->n) {
+        off_t start = seekto->write_cmd == 0 ? base : self->ends[i - 1];
+        off_t stop = i < self->n && self->ends[i] <= end ? self->ends[i] : end;
+        if (start < end && seekto->write_cmd_offset < stop - start) pos = start + seekto->write_cmd_offset;
+    }
+    pthread_rwlock_unlock(&self->lock);
+
+    if (pos == -1) errno = EINVAL;
+    return pos;
+}
+
+// Persists what is left and frees the index
+void destroySeekIndex(SeekIndex *self) {
+    if (self->fd != -1) {
+        persistEnds(self);
+        close(self->fd);
+    }
+    pthread_rwlock_destroy(&self->lock);
+    free(self->ends);
+    free(self);
+}
+
+void removeSeekIndex(const char *path) {
+    char name[PATH_MAX];
+    indexPath(name, sizeof(name), path);
+    if (unlink(name) == -1 && errno != ENOENT) logMsg(LOG_ERR, "ERROR in removeSeekIndex::unlink(%s): %m", name);
+}
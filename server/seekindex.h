@@ -0,0 +1,45 @@
+#ifndef SEEKINDEX_H
+#define SEEKINDEX_H
+
+#include "backend.h"
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#define IDXSUFFIX ".idx"
+#define IDXFLUSH 1024    // Entries buffered before they are persisted
+
+/*
+    Write-command offset index for the ordered stores (file, mem,
+    segmented file), so SEEKTO resolves in O(1) instead of scanning
+    for newlines. ends[i] is the offset just past the '\n' ending
+    write command i; command X then spans [ends[X-1], ends[X]), and
+    an unterminated tail after the last entry counts as one more
+    command, as in scanSeekto(). Commands below the retained base
+    (segmented store) are skipped through lo and compacted away.
+    The publish path appends entries under appendLock, lookups take
+    lock shared. If an entry cannot be stored the index goes _cold
+    and lookups fall back to the store's own seekto. With a path (a
+    plain file backend kept across runs by -k), entries are also
+    persisted to path.idx in IDXFLUSH batches; at
+    startup a valid index file is loaded and only the data past its
+    last entry is scanned, else the index is rebuilt from BACKEND
+    with a block-wise memchr(3) (vectorized in glibc) scan.
+*/
+typedef struct {
+    pthread_rwlock_t lock;
+    Backend *store;
+    off_t *ends;
+    size_t n, cap, lo;
+    size_t npersisted;   // Entries already in the index file
+    int fd;              // Index file, -1 if not persisted
+    int _cold;
+} SeekIndex;
+
+SeekIndex *newSeekIndex(Backend *store, const char *path);
+int indexAppend(SeekIndex *self, const char *data, size_t n, off_t off);
+off_t indexSeekto(SeekIndex *self, const struct aesd_seekto *seekto, off_t end);
+void destroySeekIndex(SeekIndex *self);
+void removeSeekIndex(const char *path);
+
+#endif /* SEEKINDEX_H */
@@ -0,0 +1,582 @@
+#include "seglog.h"
+#include "logger.h"
+#include "metrics.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define SEGDIGITS 12
+#define SCANBLK 4096
+
+
+// File of segment num, sfx ZSUFFIX once compressed
+static void segmentPath(char *buf, size_t bufsz, const char *path, long num, const char *sfx) {
+    snprintf(buf, bufsz, "%s.%0*ld%s", path, SEGDIGITS, num, sfx);
+}
+
+// Segment num, or NULL if dropped or not created yet (call with lock held)
+static Segment *lookupSegment(SegLog *log, long num) {
+    if (num < log->first || num >= log->first + log->nsegs) return NULL;
+    return log->segs[log->head + (num - log->first)];
+}
+
+static void unrefSegment(Segment *s) {
+    if (atomic_fetch_sub(&s->refs, 1) != 1) return;
+    if (s->map) munmap(s->map, s->mapsz);
+    freeZIndex(&s->z);
+    close(s->fd);
+    free(s);
+}
+
+// Opens segment file name at its full size and maps it
+static Segment *openSegment(const char *name, size_t segsize) {
+    Segment *s = (Segment *)calloc(1, sizeof(Segment));
+    if (s == NULL) {
+        logMsg(LOG_ERR, "ERROR in openSegment::calloc(3): %m");
+        return NULL;
+    }
+    if ((s->fd = open(name, O_CREAT|O_RDWR|O_TRUNC|O_CLOEXEC, 0644)) == -1) {
+        logMsg(LOG_ERR, "ERROR in openSegment::open(%s) %m", name);
+        free(s);
+        return NULL;
+    }
+    if (ftruncate(s->fd, segsize) == -1) {
+        logMsg(LOG_ERR, "ERROR in openSegment::ftruncate(%s) %m", name);
+        close(s->fd);
+        free(s);
+        return NULL;
+    }
+
+    // Without a mapping, views fall back to pread(2)
+    void *map = mmap(NULL, segsize, PROT_READ, MAP_SHARED, s->fd, 0);
+    if (map == MAP_FAILED) logMsg(LOG_ERR, "ERROR in openSegment::mmap(%s): %m", name);
+    else if (madvise(map, segsize, MADV_SEQUENTIAL) == -1) logMsg(LOG_ERR, "ERROR in openSegment::madvise(%s): %m", name);
+    s->map = map == MAP_FAILED ? NULL : (char *)map;
+    s->mapsz = segsize;
+    atomic_init(&s->refs, 1);
+    atomic_init(&s->holds, 0);
+    return s;
+}
+
+// Creates every segment up to num (call with lock held exclusively)
+static int createSegments(Backend *self, long num) {
+    SegLog *log = self->log;
+    char name[PATH_MAX];
+
+    while (log->first + log->nsegs <= num) {
+        if (log->head + log->nsegs == log->cap) {
+            // Reclaim slots of dropped segments before growing
+            if (log->head > 0) {
+                memmove(log->segs, &log->segs[log->head], log->nsegs * sizeof(Segment *));
+                log->head = 0;
+            }
+            else {
+                long cap = log->cap ? log->cap * 2 : 16;
+                Segment **segs = (Segment **)realloc(log->segs, cap * sizeof(Segment *));
+                if (segs == NULL) {
+                    logMsg(LOG_ERR, "ERROR in createSegments::realloc(3): %m");
+                    return -1;
+                }
+                log->segs = segs;
+                log->cap = cap;
+            }
+        }
+
+        long next = log->first + log->nsegs;
+        segmentPath(name, sizeof(name), self->path, next, "");
+        Segment *s = openSegment(name, log->segsize);
+        if (s == NULL) return -1;
+
+        if (log->nsegs > 0) log->segs[log->head + log->nsegs - 1]->sealed = time(NULL);
+        log->segs[log->head + log->nsegs] = s;
+        log->nsegs += 1;
+        logMsg(LOG_DEBUG, "Created segment %s", name);
+    }
+    return 0;
+}
+
+static int ensureSegment(Backend *self, long num) {
+    SegLog *log = self->log;
+
+    pthread_rwlock_rdlock(&log->lock);
+    int exists = num < log->first + log->nsegs;
+    pthread_rwlock_unlock(&log->lock);
+    if (exists) return 0;
+
+    pthread_rwlock_wrlock(&log->lock);
+    int rc = createSegments(self, num);
+    pthread_rwlock_unlock(&log->lock);
+    return rc;
+}
+
+static ssize_t segAppend(Backend *self, const char *data, size_t n, off_t off) {
+    SegLog *log = self->log;
+    size_t numWrite = 0;
+
+    while (numWrite < n) {
+        off_t pos = off + numWrite;
+        long num = pos / log->segsize;
+        size_t chunk = (num + 1) * log->segsize - pos;
+        if (chunk > n - numWrite) chunk = n - numWrite;
+        if (ensureSegment(self, num) == -1) return -1;
+
+        // Appends land at or past the published end, whose segment is never dropped
+        pthread_rwlock_rdlock(&log->lock);
+        Segment *s = lookupSegment(log, num);
+        ssize_t nw = -1;
+        for (size_t done = 0; s && done < chunk; done += nw) {
+            nw = pwrite(s->fd, data + numWrite + done, chunk - done, pos - num * log->segsize + done);
+            if (nw == -1 && errno == EINTR) nw = 0;
+            else if (nw <= 0) break;
+        }
+        pthread_rwlock_unlock(&log->lock);
+        if (nw <= 0) return -1;
+        numWrite += chunk;
+    }
+
+    // Track the highest byte written, appends may finish out of order
+    off_t end = atomic_load(&log->end);
+    while (end < off + (off_t)n && !atomic_compare_exchange_weak(&log->end, &end, off + n)) ;
+    return n;
+}
+
+// Reads segment num from segoff within it, at most up to the end of
+// the block holding segoff once compressed (call with lock held)
+static ssize_t readSegment(SegLog *log, Segment *s, long num, char *buf, size_t n, off_t segoff) {
+    ssize_t numRead;
+
+    if (s->z.index == NULL) {
+        while ((numRead = pread(s->fd, buf, n, segoff)) == -1 && errno == EINTR) ;
+        return numRead;
+    }
+
+    size_t blk = segoff / ZBLOCK;
+    if (blk >= s->z.nblocks) return 0;
+    ZSlot *slot = &log->zcache[(num + blk) % ZCACHE];
+
+    pthread_mutex_lock(&slot->lock);
+    if (slot->num != num || slot->blk != blk) {
+        if (slot->buf == NULL && (slot->buf = (char *)malloc(ZBLOCK)) == NULL) {
+            logMsg(LOG_ERR, "ERROR in readSegment::malloc(3): %m");
+            pthread_mutex_unlock(&slot->lock);
+            return -1;
+        }
+        ssize_t len = unpackBlock(s->fd, &s->z, blk, slot->buf);
+        slot->num = len == -1 ? -1 : num;
+        slot->blk = blk;
+        slot->len = len == -1 ? 0 : len;
+        if (len == -1) {
+            pthread_mutex_unlock(&slot->lock);
+            return -1;
+        }
+    }
+
+    size_t at = segoff - blk * ZBLOCK;
+    numRead = at < slot->len ? slot->len - at : 0;
+    if ((size_t)numRead > n) numRead = n;
+    memcpy(buf, slot->buf + at, numRead);
+    pthread_mutex_unlock(&slot->lock);
+    return numRead;
+}
+
+// Reads within the segment holding off only, callers loop
+static ssize_t segRead(Backend *self, char *buf, size_t n, off_t off) {
+    SegLog *log = self->log;
+    ssize_t numRead;
+
+    pthread_rwlock_rdlock(&log->lock);
+    off_t end = atomic_load(&log->end);
+    long num = off / log->segsize;
+    Segment *s = lookupSegment(log, num);
+
+    if (off >= end) numRead = 0;
+    else if (off < atomic_load(&self->base) || s == NULL) {
+        errno = ERANGE;
+        numRead = -1;
+    }
+    else {
+        size_t room = (num + 1) * log->segsize - off;
+        if (n > room) n = room;
+        if ((off_t)n > end - off) n = end - off;
+        numRead = readSegment(log, s, num, buf, n, off - num * log->segsize);
+    }
+    pthread_rwlock_unlock(&log->lock);
+    return numRead;
+}
+
+static off_t segSize(Backend *self) {
+    return atomic_load(&self->log->end);
+}
+
+// fdatasync(2)s every segment written since the last flush
+static int segFlush(Backend *self) {
+    SegLog *log = self->log;
+    int rc = 0;
+
+    pthread_rwlock_rdlock(&log->lock);
+    long num = atomic_load(&log->synced);
+    if (num < log->first) num = log->first;
+    for (; rc == 0 && num < log->first + log->nsegs; num++) rc = fdatasync(lookupSegment(log, num)->fd);
+    // The newest segment is flushed again next time, it keeps growing
+    if (rc == 0 && log->nsegs > 0) atomic_store(&log->synced, num - 1);
+    pthread_rwlock_unlock(&log->lock);
+    return rc;
+}
+
+// Offset of the first line starting at or after segment start S, given
+// data up to end (call with lock held). end if no line starts there yet.
+static off_t lineStart(SegLog *log, off_t start, off_t end) {
+    char block[SCANBLK];
+    off_t off = start - 1;
+
+    while (off < end) {
+        long num = off / log->segsize;
+        Segment *s = lookupSegment(log, num);
+        size_t want = (num + 1) * log->segsize - off;
+        if (want > SCANBLK) want = SCANBLK;
+        if ((off_t)want > end - off) want = end - off;
+
+        ssize_t numRead = s ? readSegment(log, s, num, block, want, off - num * log->segsize) : -1;
+        if (numRead <= 0) break;
+        const char *eol = memchr(block, '\n', numRead);
+        if (eol) return off + (eol - block) + 1;
+        off += numRead;
+    }
+    return end;
+}
+
+// Whether the oldest segment falls out of the retention policy, given
+// the published end. Only the trimmer moves first and base.
+static int expiredSegment(Backend *self, off_t end, time_t now) {
+    SegLog *log = self->log;
+
+    pthread_rwlock_rdlock(&log->lock);
+    Segment *s = lookupSegment(log, log->first);
+    int oversize = log->retainbytes && (size_t)(end - atomic_load(&self->base)) > log->retainbytes;
+    int expired = log->retainsec && s && s->sealed && now - s->sealed > log->retainsec;
+    pthread_rwlock_unlock(&log->lock);
+    return oversize || expired;
+}
+
+// Whether a response holds a segment starting below base, which
+// retention must not move past (call with lock held)
+static int heldBelow(SegLog *log, off_t base) {
+    for (long num = log->first; num * (off_t)log->segsize < base; num++) {
+        Segment *s = lookupSegment(log, num);
+        if (s && atomic_load(&s->holds) > 0) return 1;
+    }
+    return 0;
+}
+
+// Drops the oldest segments the retention policy no longer keeps,
+// given the published end offset. A held segment stops it until the
+// response sending from there is done, so the window may outgrow
+// the policy for that long.
+static int segTrim(Backend *self, off_t end) {
+    SegLog *log = self->log;
+    char name[PATH_MAX];
+    int ndropped = 0;
+
+    if (end == 0) return 0;
+    long active = (end - 1) / log->segsize;
+
+    // Segments below the one holding end no longer change, hand them to the packer
+    if (log->level && active > atomic_load(&log->sealedTo)) {
+        pthread_mutex_lock(&log->packLock);
+        if (active > atomic_load(&log->sealedTo)) atomic_store(&log->sealedTo, active);
+        pthread_cond_signal(&log->packCond);
+        pthread_mutex_unlock(&log->packLock);
+    }
+
+    if (pthread_mutex_trylock(&log->trimLock) != 0) return 0;
+    time_t now = log->retainsec ? time(NULL) : 0;
+
+    // Appends only take the exclusive lock when a segment actually goes
+    while (log->first < active && expiredSegment(self, end, now)) {
+        pthread_rwlock_wrlock(&log->lock);
+        Segment *s = lookupSegment(log, log->first);
+
+        // Next window starts at the first whole line of the next segment,
+        // found while the byte before it is still readable. Pinned views
+        // keep the unlinked file mapped until released.
+        off_t base = lineStart(log, (log->first + 1) * log->segsize, end);
+        if (heldBelow(log, base)) {
+            pthread_rwlock_unlock(&log->lock);
+            break;
+        }
+        segmentPath(name, sizeof(name), self->path, log->first, s->z.index ? ZSUFFIX : "");
+        if (unlink(name) == -1) logMsg(LOG_ERR, "ERROR in segTrim::unlink(%s): %m", name);
+        unrefSegment(s);
+
+        log->head += 1;
+        log->first += 1;
+        log->nsegs -= 1;
+        atomic_store(&self->base, base);
+        pthread_rwlock_unlock(&log->lock);
+        ndropped += 1;
+    }
+    pthread_mutex_unlock(&log->trimLock);
+
+    if (ndropped) logMsg(LOG_DEBUG, "Dropped %i segments, window starts at %ld", ndropped, (long)atomic_load(&self->base));
+    return 0;
+}
+
+// Compresses sealed segment num into its .z file and swaps that in
+static void packSegment(Backend *self, long num) {
+    SegLog *log = self->log;
+    char raw[PATH_MAX], name[PATH_MAX];
+
+    pthread_rwlock_rdlock(&log->lock);
+    Segment *s = lookupSegment(log, num);
+    if (s) atomic_fetch_add(&s->refs, 1);
+    pthread_rwlock_unlock(&log->lock);
+    if (s == NULL) return; // Dropped by retention first
+    else if (s->map == NULL) {
+        unrefSegment(s);
+        return;
+    }
+
+    Segment *z = (Segment *)calloc(1, sizeof(Segment));
+    segmentPath(raw, sizeof(raw), self->path, num, "");
+    segmentPath(name, sizeof(name), self->path, num, ZSUFFIX);
+    uint64_t t0 = metricsClock();
+    int fd = z ? open(name, O_CREAT|O_RDWR|O_TRUNC|O_CLOEXEC, 0644) : -1;
+
+    // Synced first, the raw file is only unlinked once this one is durable
+    if (fd == -1 || packBlocks(fd, s->map, log->segsize, log->level, &z->z) == -1 || fdatasync(fd) == -1) {
+        logMsg(LOG_ERR, "ERROR in packSegment(%s): %m", name);
+        if (fd != -1 && unlink(name) == -1) logMsg(LOG_ERR, "ERROR in packSegment::unlink(%s): %m", name);
+        if (fd != -1) close(fd);
+        if (z) freeZIndex(&z->z);
+        free(z);
+        unrefSegment(s);
+        return;
+    }
+    recordLatency(H_PACK, metricsClock() - t0);
+    countMetric(M_PACKIN, log->segsize);
+    countMetric(M_PACKOUT, z->z.packed);
+    z->fd = fd;
+    atomic_init(&z->refs, 1);
+
+    // Readers holding the raw segment keep it until they are done
+    pthread_rwlock_wrlock(&log->lock);
+    Segment *cur = lookupSegment(log, num);
+    if (cur == s) {
+        z->sealed = s->sealed;
+        atomic_init(&z->holds, atomic_load(&s->holds)); // Only change under the shared lock
+        log->segs[log->head + (num - log->first)] = z;
+        if (unlink(raw) == -1) logMsg(LOG_ERR, "ERROR in packSegment::unlink(%s): %m", raw);
+        unrefSegment(s);
+    }
+    else if (unlink(name) == -1) logMsg(LOG_ERR, "ERROR in packSegment::unlink(%s): %m", name);
+    pthread_rwlock_unlock(&log->lock);
+
+    if (cur != s) unrefSegment(z);
+    else logMsg(LOG_DEBUG, "Compressed %s: %zu -> %ld bytes", raw, log->segsize, (long)z->z.packed);
+    unrefSegment(s);
+}
+
+// Packs every sealed segment in turn until stopped
+static void *packerMain(void *arg) {
+    Backend *self = (Backend *)arg;
+    SegLog *log = self->log;
+
+    pthread_mutex_lock(&log->packLock);
+    while (log->packing) {
+        if (log->packed >= atomic_load(&log->sealedTo)) {
+            pthread_cond_wait(&log->packCond, &log->packLock);
+            continue;
+        }
+        long num = log->packed;
+        pthread_mutex_unlock(&log->packLock);
+
+        packSegment(self, num);
+
+        pthread_mutex_lock(&log->packLock);
+        log->packed = num + 1;
+    }
+    pthread_mutex_unlock(&log->packLock);
+    return NULL;
+}
+
+// Pins the segment holding off and returns its mapping there, within
+// the segment, the retained window and what was written below end
+static const char *segView(Backend *self, off_t off, off_t end, size_t *n, void **pin) {
+    SegLog *log = self->log;
+    const char *mem = NULL;
+
+    pthread_rwlock_rdlock(&log->lock);
+    long num = off / log->segsize;
+    Segment *s = lookupSegment(log, num);
+    off_t written = atomic_load(&log->end);
+    off_t stop = (num + 1) * log->segsize;
+    if (stop > end) stop = end;
+    if (stop > written) stop = written;
+
+    if (s && s->map && off >= atomic_load(&self->base) && off < stop) {
+        atomic_fetch_add(&s->refs, 1);
+        *n = stop - off;
+        *pin = s;
+        mem = s->map + (off - num * log->segsize);
+    }
+    pthread_rwlock_unlock(&log->lock);
+    return mem;
+}
+
+static void segRelease(Backend *self, void *pin) {
+    (void)self;
+    if (pin) unrefSegment((Segment *)pin);
+}
+
+// Holds the segment with off, raised to base first (the newest one if
+// off is past them all): retention keeps base at or below its start
+static off_t segHold(Backend *self, off_t off, long *token) {
+    SegLog *log = self->log;
+
+    pthread_rwlock_rdlock(&log->lock);
+    off_t base = atomic_load(&self->base);
+    if (off < base) off = base;
+    long num = off / log->segsize;
+    if (num >= log->first + log->nsegs) num = log->first + log->nsegs - 1;
+    Segment *s = lookupSegment(log, num);
+    if (s) atomic_fetch_add(&s->holds, 1);
+    *token = s ? num : -1;
+    pthread_rwlock_unlock(&log->lock);
+    return off;
+}
+
+static void segUnhold(Backend *self, long token) {
+    SegLog *log = self->log;
+    if (token == -1) return;
+
+    // A held segment is never dropped, only swapped for its .z
+    pthread_rwlock_rdlock(&log->lock);
+    atomic_fetch_sub(&lookupSegment(log, token)->holds, 1);
+    pthread_rwlock_unlock(&log->lock);
+}
+
+static void segClose(Backend *self) {
+    SegLog *log = self->log;
+    stopPacking(self);
+    for (long i = 0; i < log->nsegs; i++) unrefSegment(log->segs[log->head + i]);
+    for (int i = 0; i < ZCACHE; i++) {
+        free(log->zcache[i].buf);
+        pthread_mutex_destroy(&log->zcache[i].lock);
+    }
+    free(log->segs);
+    pthread_rwlock_destroy(&log->lock);
+    pthread_mutex_destroy(&log->trimLock);
+    pthread_mutex_destroy(&log->packLock);
+    pthread_cond_destroy(&log->packCond);
+    free(log);
+    self->log = NULL;
+}
+
+static const BackendOps segmentOps = {
+    segAppend, segRead, scanSeekto, segSize, segFlush, segTrim, segView, segRelease, segHold, segUnhold, segClose
+};
+
+Backend *newSegmentedBackend(const char *path, size_t segsize, size_t retainbytes, long retainsec) {
+    Backend *self = (Backend *)calloc(1, sizeof(Backend));
+    SegLog *log = (SegLog *)calloc(1, sizeof(SegLog));
+    if (self == NULL || log == NULL) {
+        logMsg(LOG_ERR, "ERROR in newSegmentedBackend::calloc(3): %m");
+        free(self);
+        free(log);
+        return NULL;
+    }
+
+    log->segsize = segsize > 0 ? segsize : SEGSIZE;
+    log->retainbytes = retainbytes;
+    log->retainsec = retainsec;
+    pthread_rwlock_init(&log->lock, NULL);
+    pthread_mutex_init(&log->trimLock, NULL);
+    pthread_mutex_init(&log->packLock, NULL);
+    pthread_cond_init(&log->packCond, NULL);
+    atomic_init(&log->synced, 0);
+    atomic_init(&log->end, 0);
+    atomic_init(&log->sealedTo, 0);
+    for (int i = 0; i < ZCACHE; i++) {
+        pthread_mutex_init(&log->zcache[i].lock, NULL);
+        log->zcache[i].num = -1;
+    }
+
+    self->ops = &segmentOps;
+    self->kind = BACKEND_FILE;
+    self->path = path;
+    self->fd = -1;
+    self->ordered = 1;
+    self->log = log;
+    atomic_init(&self->base, 0);
+    atomic_init(&self->memEnd, 0);
+    pthread_mutex_init(&self->seekLock, NULL);
+
+    logMsg(LOG_DEBUG, "Opened segmented backend %s (%zu byte segments, keep %zu bytes, %li s)",
+        path, log->segsize, retainbytes, retainsec);
+    return self;
+}
+
+// Starts the packer thread, which compresses sealed segments at zlib
+// level. Call after any fork. Returns -1 on ERROR.
+int startPacking(Backend *self, int level) {
+    SegLog *log = self->log;
+    int err;
+
+    log->level = level < Z_BEST_SPEED ? Z_BEST_SPEED : level > Z_BEST_COMPRESSION ? Z_BEST_COMPRESSION : level;
+    log->packing = 1;
+    if ((err = pthread_create(&log->packer, NULL, packerMain, self)) != 0) {
+        logMsg(LOG_ERR, "ERROR in startPacking::pthread_create(3): %s", strerror(err));
+        log->packing = 0;
+        log->level = 0;
+        return -1;
+    }
+
+    logMsg(LOG_DEBUG, "Compressing sealed segments of %s at level %i", self->path, log->level);
+    return 0;
+}
+
+// Stops the packer, once the segment it is compressing is swapped in
+void stopPacking(Backend *self) {
+    SegLog *log = self->log;
+
+    pthread_mutex_lock(&log->packLock);
+    int running = log->packing;
+    log->packing = 0;
+    pthread_cond_signal(&log->packCond);
+    pthread_mutex_unlock(&log->packLock);
+
+    if (running) pthread_join(log->packer, NULL);
+}
+
+// Unlinks every segment file of path
+void removeSegments(const char *path) {
+    char dirbuf[PATH_MAX], basebuf[PATH_MAX], name[PATH_MAX];
+    snprintf(dirbuf, sizeof(dirbuf), "%s", path);
+    snprintf(basebuf, sizeof(basebuf), "%s", path);
+    const char *dir = dirname(dirbuf), *base = basename(basebuf);
+    size_t baselen = strlen(base);
+
+    DIR *d = opendir(dir);
+    if (d == NULL) return;
+
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        const char *sfx = ent->d_name + baselen + 1;
+        if (strncmp(ent->d_name, base, baselen) != 0 || ent->d_name[baselen] != '.') continue;
+        else if (strspn(sfx, "0123456789") != SEGDIGITS) continue;
+        else if (strcmp(sfx + SEGDIGITS, "") != 0 && strcmp(sfx + SEGDIGITS, ZSUFFIX) != 0) continue;
+
+        snprintf(name, sizeof(name), "%s/%s", dir, ent->d_name);
+        if (unlink(name) == -1) logMsg(LOG_ERR, "ERROR in removeSegments::unlink(%s): %m", name);
+    }
+    closedir(d);
+}
@@ -0,0 +1,97 @@
+#ifndef SEGLOG_H
+#define SEGLOG_H
+
+#include "backend.h"
+#include "zblock.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+
+#define SEGSIZE ((size_t)16 << 20) // Default segment size (-S)
+#define ZSUFFIX ".z"
+#define ZCACHE 4                   // Inflated blocks kept for readers
+
+/*
+    One segment file, sized to segsize up front (sparse) so map, its
+    read-only shared mapping, never faults. sealed is when the next
+    segment was created (its age for retention), 0 while it is the
+    newest. refs counts the log's own reference plus every pinned
+    view; the last one unmaps and closes a dropped segment. holds
+    counts responses sending from it onward (see segHold). Once
+    compressed, fd is the path.NNNNNNNNNNNN.z file, z its block index
+    and map NULL (z.index is NULL while the segment is raw).
+*/
+typedef struct {
+    int fd;
+    time_t sealed;
+    char *map;
+    size_t mapsz;
+    ZIndex z;
+    atomic_int refs;
+    atomic_int holds;
+} Segment;
+
+// Last block inflated through one cache slot (num -1 when empty)
+typedef struct {
+    pthread_mutex_t lock;
+    long num;
+    size_t blk, len;
+    char *buf;
+} ZSlot;
+
+/*
+    Segmented append log behind the file backend (-S/-R/-A). BACKEND
+    becomes fixed-size segment files path.NNNNNNNNNNNN: segment i holds
+    logical offsets [i*segsize, (i+1)*segsize), so any offset maps to
+    its file in O(1) and an append crossing a boundary is split.
+    Logical offsets only grow. Retention keeps the window [base, end):
+    whole segments are dropped oldest first, by unlinking their file
+    (no data is rewritten), while the window exceeds retainbytes or
+    the oldest segment was sealed more than retainsec ago (0 disables
+    either). The segment holding the published end is never dropped,
+    and base moves to the first line that starts in the oldest kept
+    segment, so SEEKTO counts write commands from there, as the char
+    driver counts from its oldest kept write.
+    lock is held shared around each pread/pwrite and exclusively to
+    create or drop segments, so no reader uses a closed fd. Views
+    pin their segment instead, so they stay valid while it is sent
+    from without the lock. Reads below base fail with ERANGE, and a
+    response holds its first segment so base never passes it midway.
+    With compression (-Z level), a packer thread deflates every
+    segment wholly below the published end into ZBLOCK blocks, syncs
+    the .z file and swaps it in for the raw one under the exclusive
+    lock. Reads of a compressed segment inflate the block holding the
+    offset into one of ZCACHE slots, so sequential readers inflate
+    each block once; such segments have no view and are copied.
+*/
+struct SegLog {
+    size_t segsize, retainbytes;
+    long retainsec;
+
+    pthread_rwlock_t lock;
+    Segment **segs;       // segs[head + i] is segment first + i
+    long head, cap;
+    long first, nsegs;
+    atomic_long synced;   // Segments below it are flushed
+    _Atomic off_t end;    // Highest byte written
+
+    pthread_mutex_t trimLock; // One trimmer at a time, others skip
+
+    int level;            // zlib level, 0 keeps segments raw
+    atomic_long sealedTo; // Segments below it are published whole
+    long packed;          // Segments below it are compressed or dropped
+    int packing;
+    pthread_t packer;
+    pthread_mutex_t packLock;
+    pthread_cond_t packCond;
+    ZSlot zcache[ZCACHE];
+};
+
+Backend *newSegmentedBackend(const char *path, size_t segsize, size_t retainbytes, long retainsec);
+int startPacking(Backend *self, int level);
+void stopPacking(Backend *self);
+void removeSegments(const char *path);
+
+#endif /* SEGLOG_H */
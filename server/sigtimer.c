@@ -0,0 +1,76 @@
+#include "sigtimer.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+
+int openSignalFd() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+
+    // sendfile(2) and splice(2) to a closed peer raise SIGPIPE, unlike
+    // send(2) with MSG_NOSIGNAL; the EPIPE they return is enough
+    int sigfd;
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        logMsg(LOG_ERR, "ERROR in openSignalFd::signal(2): %m");
+        return -1;
+    }
+    else if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        logMsg(LOG_ERR, "ERROR in openSignalFd::sigprocmask(2): %m");
+        return -1;
+    }
+    else if ((sigfd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC)) == -1) {
+        logMsg(LOG_ERR, "ERROR in openSignalFd::signalfd(2): %m");
+        return -1;
+    }
+    return sigfd;
+}
+
+// Drains sigfd. Returns 1 if SIGINT/SIGTERM was caught, else 0.
+int readExitSignal(int sigfd) {
+    struct signalfd_siginfo si;
+    int caught = 0;
+
+    while (read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGINT || si.ssi_signo == SIGTERM) caught = 1;
+    }
+    return caught;
+}
+
+int openTimestampTimer(long intervalsec) {
+    if (intervalsec <= 0) return -1;
+
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (tfd == -1) {
+        logMsg(LOG_ERR, "ERROR in openTimestampTimer::timerfd_create(2): %m");
+        return -1;
+    }
+
+    struct itimerspec its;
+    its.it_value.tv_sec = intervalsec;
+    its.it_value.tv_nsec = 0;
+    its.it_interval.tv_sec = intervalsec;
+    its.it_interval.tv_nsec = 0;
+    if (timerfd_settime(tfd, 0, &its, NULL) == -1) {
+        logMsg(LOG_ERR, "ERROR in openTimestampTimer::timerfd_settime(2): %m");
+        close(tfd);
+        return -1;
+    }
+    return tfd;
+}
+
+// Returns expirations since the last read (0 if none or on ERROR)
+uint64_t readTimer(int tfd) {
+    uint64_t n;
+    if (read(tfd, &n, sizeof(n)) != sizeof(n)) {
+        if (errno != EAGAIN) logMsg(LOG_ERR, "ERROR in readTimer::read(%i): %m", tfd);
+        return 0;
+    }
+    return n;
+}
@@ -0,0 +1,23 @@
+#ifndef SIGTIMER_H
+#define SIGTIMER_H
+
+#include <stdint.h>
+
+/*
+    Signals and timers delivered as file descriptors, so every event
+    loop waits on them next to its sockets. openSignalFd() blocks
+    SIGINT/SIGTERM process-wide (call before spawning threads so they
+    inherit the mask) and returns a non-blocking signalfd for them;
+    it also ignores SIGPIPE, so a client hanging up mid-response
+    only fails that send.
+    openTimestampTimer() returns a periodic CLOCK_MONOTONIC timerfd
+    firing every intervalsec seconds (-1 on ERROR, or if disabled with
+    intervalsec <= 0). Expirations are counted by the kernel, so the
+    cadence does not drift with loop latency.
+*/
+int openSignalFd();
+int readExitSignal(int sigfd);
+int openTimestampTimer(long intervalsec);
+uint64_t readTimer(int tfd);
+
+#endif /* SIGTIMER_H */
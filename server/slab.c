@@ -0,0 +1,250 @@
+#include "slab.h"
+#include "logger.h"
+
+#include <stdlib.h>
+
+#define ARENAHDR 16   // Keeps carved objects 16-byte aligned
+#define NCLASSES 12   // BLOCKMIN << 0 .. BLOCKMIN << 11 == BLOCKMAX
+#define CLASSBYTES (4 << 20) // Shared free list cap per block class
+
+struct SlabObj {
+    SlabObj *next;
+};
+
+struct SlabArena {
+    SlabArena *next;
+};
+
+typedef struct {
+    void *objs[SLABCACHE];
+    int n;
+} SlabCache;
+
+static Slab *registry[SLABMAX];
+static int nslabs = 0;
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Per-thread caches, flushed to the shared lists when the thread exits
+static __thread SlabCache caches[SLABMAX];
+static __thread int cacheKeySet = 0;
+static pthread_key_t cacheKey;
+static pthread_once_t cacheKeyOnce = PTHREAD_ONCE_INIT;
+
+static Slab blockSlabs[NCLASSES];
+static pthread_once_t blockOnce = PTHREAD_ONCE_INIT;
+
+
+// Moves n objects to the shared free list (or back to free(3) past maxfree)
+static void pushShared(Slab *self, void **objs, int n) {
+    pthread_mutex_lock(&self->lock);
+    for (int i = 0; i < n; i++) {
+        if (self->perarena == 1 && self->nfree >= self->maxfree) {
+            free(objs[i]);
+            atomic_fetch_add_explicit(&self->released, 1, memory_order_relaxed);
+            continue;
+        }
+        SlabObj *o = (SlabObj *)objs[i];
+        o->next = self->freelist;
+        self->freelist = o;
+        self->nfree += 1;
+    }
+    pthread_mutex_unlock(&self->lock);
+}
+
+static int popShared(Slab *self, void **objs, int want) {
+    int n = 0;
+    pthread_mutex_lock(&self->lock);
+    while (n < want && self->freelist) {
+        objs[n++] = self->freelist;
+        self->freelist = self->freelist->next;
+        self->nfree -= 1;
+    }
+    pthread_mutex_unlock(&self->lock);
+    return n;
+}
+
+static void flushCaches(void *unused) {
+    (void)unused;
+    for (int i = 0; i < SLABMAX; i++) {
+        if (caches[i].n > 0 && registry[i]) pushShared(registry[i], caches[i].objs, caches[i].n);
+        caches[i].n = 0;
+    }
+}
+
+static void createCacheKey() {
+    pthread_key_create(&cacheKey, flushCaches);
+}
+
+// Registers this thread's caches for flushing at pthread exit
+static void markCacheThread() {
+    if (cacheKeySet) return;
+    pthread_setspecific(cacheKey, &caches);
+    cacheKeySet = 1;
+}
+
+int initSlab(Slab *self, const char *name, size_t objsz, size_t perarena, size_t maxfree) {
+    pthread_once(&cacheKeyOnce, createCacheKey);
+
+    pthread_mutex_lock(&registryLock);
+    if (nslabs == SLABMAX) {
+        pthread_mutex_unlock(&registryLock);
+        logMsg(LOG_ERR, "ERROR in initSlab: more than %i Slabs", SLABMAX);
+        return -1;
+    }
+    self->index = nslabs++;
+    registry[self->index] = self;
+    pthread_mutex_unlock(&registryLock);
+
+    if (objsz < sizeof(SlabObj)) objsz = sizeof(SlabObj);
+    self->name = name;
+    self->objsz = (objsz + ARENAHDR - 1) & ~(size_t)(ARENAHDR - 1);
+    self->perarena = perarena > 0 ? perarena : 1;
+    self->maxfree = maxfree;
+    pthread_mutex_init(&self->lock, NULL);
+    self->freelist = NULL;
+    self->nfree = 0;
+    self->arenas = NULL;
+    atomic_init(&self->allocs, 0);
+    atomic_init(&self->frees, 0);
+    atomic_init(&self->fresh, 0);
+    atomic_init(&self->released, 0);
+    return 0;
+}
+
+// Gets new objects from malloc(3): one arena carved into perarena
+// objects (the rest go to the shared list), or a single object
+static void *freshObj(Slab *self) {
+    atomic_fetch_add_explicit(&self->fresh, 1, memory_order_relaxed);
+    if (self->perarena == 1) {
+        void *obj = malloc(self->objsz);
+        if (obj == NULL) logMsg(LOG_ERR, "ERROR in freshObj::malloc(3): %m");
+        return obj;
+    }
+
+    SlabArena *a = (SlabArena *)malloc(ARENAHDR + self->perarena * self->objsz);
+    if (a == NULL) {
+        logMsg(LOG_ERR, "ERROR in freshObj::malloc(3): %m");
+        return NULL;
+    }
+
+    char *base = (char *)a + ARENAHDR;
+    pthread_mutex_lock(&self->lock);
+    a->next = self->arenas;
+    self->arenas = a;
+    for (size_t i = self->perarena - 1; i > 0; i--) {
+        SlabObj *o = (SlabObj *)(base + i * self->objsz);
+        o->next = self->freelist;
+        self->freelist = o;
+        self->nfree += 1;
+    }
+    pthread_mutex_unlock(&self->lock);
+    return base;
+}
+
+void *slabAlloc(Slab *self) {
+    SlabCache *cache = &caches[self->index];
+    atomic_fetch_add_explicit(&self->allocs, 1, memory_order_relaxed);
+
+    if (cache->n == 0) {
+        markCacheThread();
+        cache->n = popShared(self, cache->objs, SLABCACHE / 2);
+    }
+    if (cache->n > 0) return cache->objs[--cache->n];
+    return freshObj(self);
+}
+
+void slabFree(Slab *self, void *obj) {
+    SlabCache *cache = &caches[self->index];
+    if (obj == NULL) return;
+    atomic_fetch_add_explicit(&self->frees, 1, memory_order_relaxed);
+
+    if (cache->n == SLABCACHE) {
+        pushShared(self, &cache->objs[SLABCACHE / 2], SLABCACHE / 2);
+        cache->n = SLABCACHE / 2;
+    }
+    markCacheThread();
+    cache->objs[cache->n++] = obj;
+}
+
+void logSlabStats(Slab *self) {
+    logMsg(LOG_DEBUG, "Slab %s: %lu allocs, %lu frees, %lu malloc(3), %lu free(3), %zu pooled",
+        self->name, atomic_load(&self->allocs), atomic_load(&self->frees),
+        atomic_load(&self->fresh), atomic_load(&self->released), self->nfree);
+}
+
+// Frees every pooled object (and arena); live objects must be gone
+void destroySlab(Slab *self) {
+    pthread_mutex_lock(&registryLock);
+    registry[self->index] = NULL;
+    pthread_mutex_unlock(&registryLock);
+
+    // Only the calling thread's cache is still alive at this point
+    SlabCache *cache = &caches[self->index];
+    if (self->perarena == 1) {
+        for (int i = 0; i < cache->n; i++) free(cache->objs[i]);
+        while (self->freelist) {
+            SlabObj *nxt = self->freelist->next;
+            free(self->freelist);
+            self->freelist = nxt;
+        }
+    }
+    cache->n = 0;
+
+    while (self->arenas) {
+        SlabArena *nxt = self->arenas->next;
+        free(self->arenas);
+        self->arenas = nxt;
+    }
+    self->freelist = NULL;
+    self->nfree = 0;
+    pthread_mutex_destroy(&self->lock);
+}
+
+static void initBlockSlabs() {
+    static const char *names[NCLASSES] = { "block512", "block1K", "block2K", "block4K",
+        "block8K", "block16K", "block32K", "block64K", "block128K", "block256K", "block512K", "block1M" };
+
+    for (int k = 0; k < NCLASSES; k++) {
+        size_t sz = (size_t)BLOCKMIN << k;
+        size_t maxfree = CLASSBYTES / sz;
+        if (maxfree > 256) maxfree = 256;
+        else if (maxfree < 4) maxfree = 4;
+        initSlab(&blockSlabs[k], names[k], sz, 1, maxfree);
+    }
+}
+
+static int blockClass(size_t size) {
+    int k = 0;
+    while (((size_t)BLOCKMIN << k) < size) k++;
+    return k;
+}
+
+void *allocBlock(size_t *size) {
+    if (*size > BLOCKMAX) {
+        void *block = malloc(*size);
+        if (block == NULL) logMsg(LOG_ERR, "ERROR in allocBlock::malloc(3): %m");
+        return block;
+    }
+
+    pthread_once(&blockOnce, initBlockSlabs);
+    int k = blockClass(*size);
+    *size = (size_t)BLOCKMIN << k;
+    return slabAlloc(&blockSlabs[k]);
+}
+
+void freeBlock(void *block, size_t size) {
+    if (size > BLOCKMAX) free(block);
+    else slabFree(&blockSlabs[blockClass(size)], block);
+}
+
+void logBlockStats() {
+    pthread_once(&blockOnce, initBlockSlabs);
+    for (int k = 0; k < NCLASSES; k++) {
+        if (atomic_load(&blockSlabs[k].allocs) > 0) logSlabStats(&blockSlabs[k]);
+    }
+}
+
+void destroyBlocks() {
+    pthread_once(&blockOnce, initBlockSlabs);
+    for (int k = 0; k < NCLASSES; k++) destroySlab(&blockSlabs[k]);
+}
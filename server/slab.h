@@ -0,0 +1,56 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define SLABMAX 16     // Max registered Slabs (per-thread cache slots)
+#define SLABCACHE 16   // Objects cached per thread per Slab
+
+/*
+    Pool of fixed-size objects. Each thread keeps up to SLABCACHE
+    freed objects per Slab and only takes the shared lock to move
+    half a cache to or from the shared free list. When perarena > 1
+    objects are carved from malloc'd arenas that live until
+    destroySlab(); otherwise each object is its own malloc and the
+    shared free list is capped at maxfree, excess going back to free(3).
+    Counters: allocs/frees served, fresh = objects that had to come
+    from malloc, which stops growing once churn reaches steady state.
+*/
+typedef struct SlabObj SlabObj;
+typedef struct SlabArena SlabArena;
+
+typedef struct {
+    const char *name;
+    size_t objsz, perarena, maxfree;
+    int index;
+
+    pthread_mutex_t lock;
+    SlabObj *freelist;
+    size_t nfree;
+    SlabArena *arenas;
+
+    atomic_ulong allocs, frees, fresh, released;
+} Slab;
+
+int initSlab(Slab *self, const char *name, size_t objsz, size_t perarena, size_t maxfree);
+void *slabAlloc(Slab *self);
+void slabFree(Slab *self, void *obj);
+void logSlabStats(Slab *self);
+void destroySlab(Slab *self);
+
+/*
+    Power-of-two size classes from BLOCKMIN to BLOCKMAX bytes for
+    LineBuffer storage, each backed by its own Slab. Larger requests
+    bypass the pools. allocBlock() rounds *size up to its class size.
+*/
+#define BLOCKMIN 512
+#define BLOCKMAX (1 << 20)
+
+void *allocBlock(size_t *size);
+void freeBlock(void *block, size_t size);
+void logBlockStats();
+void destroyBlocks();
+
+#endif /* SLAB_H */
@@ -0,0 +1,169 @@
+#include "threadpool.h"
+#include "logger.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+
+static void *poolWorkerMain(void *vself) {
+    PoolWorker *self = (PoolWorker *)vself;
+    ThreadPool *pool = self->pool;
+    PendingConn pc;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->qlen == 0 && !pool->_shutdown)
+            pthread_cond_wait(&pool->notEmpty, &pool->lock);
+
+        if (pool->_shutdown) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        // Dequeue and publish cfd so shutdown can interrupt a blocked read
+        int wasFull = pool->qlen == pool->qdepth;
+        pc = pool->queue[pool->qhead];
+        pool->qhead = (pool->qhead + 1) % pool->qdepth;
+        pool->qlen -= 1;
+        self->ct->cfd = pc.cfd;
+        self->ct->claddr = pc.claddr;
+        resetConnThread(self->ct);
+        pthread_mutex_unlock(&pool->lock);
+
+        // Wake the producer, it stopped accepting while the queue was full
+        uint64_t one = 1;
+        if (wasFull && write(pool->slotfd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            logMsg(LOG_ERR, "ERROR in poolWorkerMain::write(%i): %m", pool->slotfd);
+
+        serveConnection(self->ct, &self->line);
+
+        pthread_mutex_lock(&pool->lock);
+        self->ct->cfd = -1;
+        pthread_mutex_unlock(&pool->lock);
+        close(pc.cfd);
+        countMetric(M_CLOSED, 1);
+    }
+
+    return vself;
+}
+
+ThreadPool *newThreadPool(size_t nworkers, size_t qdepth, const char *backend) {
+    int err;
+
+    ThreadPool *self = (ThreadPool *)calloc(1, sizeof(ThreadPool));
+    if (self == NULL) {
+        logMsg(LOG_ERR, "ERROR in newThreadPool::calloc(3): %m");
+        return NULL;
+    }
+
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->notEmpty, NULL);
+
+    self->qdepth = qdepth;
+    self->slotfd = -1;
+    if ((self->slotfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1) {
+        logMsg(LOG_ERR, "ERROR in newThreadPool::eventfd(2): %m");
+        shutdownThreadPool(self);
+        return NULL;
+    }
+    else if ((self->queue = (PendingConn *)calloc(qdepth, sizeof(PendingConn))) == NULL ||
+        (self->workers = (PoolWorker *)calloc(nworkers, sizeof(PoolWorker))) == NULL) {
+        logMsg(LOG_ERR, "ERROR in newThreadPool::calloc(3): %m");
+        shutdownThreadPool(self);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < nworkers; i++) {
+        PoolWorker *w = &self->workers[i];
+        w->pool = self;
+        w->line = newLineBuffer();
+        if ((w->ct = newConnThread(backend)) == NULL || w->line.data == NULL) {
+            destroy(&w->line);
+            freeConnThread(w->ct);
+            shutdownThreadPool(self);
+            return NULL;
+        }
+        else if ((err = pthread_create(&w->thread, NULL, poolWorkerMain, w)) != 0) {
+            logMsg(LOG_ERR, "ERROR in newThreadPool::pthread_create(3): %s", strerror(err));
+            destroy(&w->line);
+            freeConnThread(w->ct);
+            shutdownThreadPool(self);
+            return NULL;
+        }
+        self->nworkers += 1;
+    }
+
+    logMsg(LOG_DEBUG, "Started ThreadPool with %zu workers, queue depth %zu", nworkers, qdepth);
+    return self;
+}
+
+// Returns 1 if a queue slot is free (the only producer may then submit
+// without blocking). Otherwise slotfd becomes readable once one frees.
+int hasPoolSlot(ThreadPool *self) {
+    uint64_t n;
+    if (read(self->slotfd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+        logMsg(LOG_ERR, "ERROR in hasPoolSlot::read(%i): %m", self->slotfd);
+
+    pthread_mutex_lock(&self->lock);
+    int hasSlot = self->qlen < self->qdepth;
+    pthread_mutex_unlock(&self->lock);
+    return hasSlot;
+}
+
+int submitConn(ThreadPool *self, PendingConn *pc) {
+    pthread_mutex_lock(&self->lock);
+    if (self->qlen == self->qdepth || self->_shutdown) {
+        pthread_mutex_unlock(&self->lock);
+        logMsg(LOG_ERR, "ERROR in submitConn: ThreadPool queue full");
+        return -1;
+    }
+
+    self->queue[(self->qhead + self->qlen) % self->qdepth] = *pc;
+    self->qlen += 1;
+    pthread_cond_signal(&self->notEmpty);
+    pthread_mutex_unlock(&self->lock);
+    return 0;
+}
+
+void shutdownThreadPool(ThreadPool *self) {
+    int err, pcnt = 0;
+
+    // Flag workers and unblock any active connection reads
+    pthread_mutex_lock(&self->lock);
+    self->_shutdown = 1;
+    for (size_t i = 0; i < self->nworkers; i++) {
+        ConnThread *ct = self->workers[i].ct;
+        ct->_exitflag = 1;
+        if (ct->cfd != -1) shutdown(ct->cfd, SHUT_RDWR);
+    }
+    pthread_cond_broadcast(&self->notEmpty);
+    pthread_mutex_unlock(&self->lock);
+
+    for (size_t i = 0; i < self->nworkers; i++) {
+        PoolWorker *w = &self->workers[i];
+        logMsg(LOG_DEBUG, "Joining pool worker %i in shutdownThreadPool", w->ct->tid);
+        if ((err = pthread_join(w->thread, NULL)) != 0)
+            logMsg(LOG_ERR, "ERROR in shutdownThreadPool::pthread_join(3): %s", strerror(err));
+
+        destroy(&w->line);
+        freeConnThread(w->ct);
+        pcnt += 1;
+    }
+
+    // Drop connections that were never picked up
+    for (; self->qlen; self->qlen--) {
+        close(self->queue[self->qhead].cfd);
+        countMetric(M_CLOSED, 1);
+        self->qhead = (self->qhead + 1) % self->qdepth;
+    }
+
+    pthread_cond_destroy(&self->notEmpty);
+    pthread_mutex_destroy(&self->lock);
+    if (self->slotfd != -1) close(self->slotfd);
+    free(self->workers);
+    free(self->queue);
+    free(self);
+    logMsg(LOG_DEBUG, "Terminated %i pool workers", pcnt);
+}
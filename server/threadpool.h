@@ -0,0 +1,55 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include "connthread.h"
+
+/*
+    Accepted client connection waiting in ThreadPool queue.
+*/
+typedef struct {
+    int cfd;
+    struct sockaddr_storage claddr;
+} PendingConn;
+
+/*
+    Pre-spawned worker of a ThreadPool. Owns a ConnThread and a
+    LineBuffer that are reused for every connection it serves,
+    so no per-connection thread or buffer allocation is needed.
+*/
+typedef struct ThreadPool ThreadPool;
+
+typedef struct {
+    ThreadPool *pool;
+    pthread_t thread;
+    ConnThread *ct;
+    LineBuffer line;
+} PoolWorker;
+
+/*
+    Fixed-size pool of workers fed from a bounded ring queue of
+    accepted connections. Producer checks hasPoolSlot() before
+    accept(2) so that, when the queue is full, pending clients are
+    left in the listen backlog (backpressure) instead of spawning
+    more threads. Meanwhile it waits on slotfd (an eventfd), which
+    a worker signals when it dequeues from a full queue. Call
+    shutdownThreadPool() to stop and join workers and free the pool.
+*/
+struct ThreadPool {
+    PoolWorker *workers;
+    size_t nworkers;
+
+    PendingConn *queue;
+    size_t qdepth, qhead, qlen;
+
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    int slotfd;
+    int _shutdown;
+};
+
+ThreadPool *newThreadPool(size_t nworkers, size_t qdepth, const char *backend);
+int hasPoolSlot(ThreadPool *self);
+int submitConn(ThreadPool *self, PendingConn *pc);
+void shutdownThreadPool(ThreadPool *self);
+
+#endif /* THREADPOOL_H */
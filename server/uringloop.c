@@ -0,0 +1,843 @@
+#include "uringloop.h"
+#include "logger.h"
+#include "metrics.h"
+#include "sigtimer.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define RINGENTRIES 256
+#define SENDIOV 16
+
+// Fixed file table: backend, listen socket, signalfd, timerfd, then one per slot
+#define BACKENDFILE 0
+#define LISTENFILE 1
+#define SIGNALFILE 2
+#define TIMERFILE 3
+#define CONNFILE(slot) (4 + (slot))
+#define NFILES CONNFILE(URINGSLOTS)
+
+// Operation tag kept in the low bits of user_data (pointers are 8-aligned)
+enum { UOP_ACCEPT = 1, UOP_POLL, UOP_RECV, UOP_APPEND, UOP_SENDMSG, UOP_READ, UOP_SEND };
+#define UOPMASK 7
+
+// UOP_POLL pointers telling the signalfd and timerfd polls apart
+static uint64_t signalTag, timerTag;
+
+static Uring ring;
+static UringConn *slots[URINGSLOTS];
+static UringConn *freeList = NULL;
+static AppendNode *fifoHead = NULL, *fifoTail = NULL;
+static UringConn *acceptSlot = NULL; // Slot reserved by the armed accept
+static int acceptArmed = 0, signalArmed = 0, timerArmed = 0, nconns = 0;
+static int stopping = 0;
+
+static int closeConn(UringConn *c);
+
+
+static int setupUring(Uring *r, unsigned entries, unsigned *features) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+
+    if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) == -1) return -1;
+
+    r->sqringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqringsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqessz = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqringsz > r->sqringsz) r->sqringsz = r->cqringsz;
+        r->cqringsz = r->sqringsz;
+    }
+
+    r->sqring = mmap(NULL, r->sqringsz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cqring = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sqring :
+        mmap(NULL, r->cqringsz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqessz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqring == MAP_FAILED || r->cqring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        logMsg(LOG_ERR, "ERROR in setupUring::mmap(2): %m");
+        if (r->sqes != MAP_FAILED) munmap(r->sqes, r->sqessz);
+        if (r->cqring != MAP_FAILED && r->cqring != r->sqring) munmap(r->cqring, r->cqringsz);
+        if (r->sqring != MAP_FAILED) munmap(r->sqring, r->sqringsz);
+        close(r->fd);
+        return -1;
+    }
+
+    char *sq = (char *)r->sqring, *cq = (char *)r->cqring;
+    r->sqhead = (unsigned *)(sq + p.sq_off.head);
+    r->sqtail = (unsigned *)(sq + p.sq_off.tail);
+    r->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sqarray = (unsigned *)(sq + p.sq_off.array);
+    r->cqhead = (unsigned *)(cq + p.cq_off.head);
+    r->cqtail = (unsigned *)(cq + p.cq_off.tail);
+    r->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->sqentries = p.sq_entries;
+    if (features) *features = p.features;
+    return 0;
+}
+
+static void teardownUring(Uring *r) {
+    munmap(r->sqes, r->sqessz);
+    if (r->cqring != r->sqring) munmap(r->cqring, r->cqringsz);
+    munmap(r->sqring, r->sqringsz);
+    close(r->fd);
+    free(r->stash);
+    r->stash = NULL;
+}
+
+// Publishes queued SQEs and optionally waits for minwait completions
+static int enterUring(unsigned minwait) {
+    unsigned flags = minwait ? IORING_ENTER_GETEVENTS : 0;
+
+    // Only SQEs filled since the last publish move the tail, earlier
+    // ones the kernel did not take are still in front of them
+    if (ring.unpublished) {
+        __atomic_store_n(ring.sqtail, *ring.sqtail + ring.unpublished, __ATOMIC_RELEASE);
+        ring.pending += ring.unpublished;
+        ring.unpublished = 0;
+    }
+
+    while (1) {
+        int n = syscall(__NR_io_uring_enter, ring.fd, ring.pending, minwait, flags, NULL, 0);
+        ring.nenter += 1;
+        if (n >= 0) {
+            ring.pending -= n;
+            return 0;
+        }
+        else if (errno == EINTR) continue;
+        else if (errno == EBUSY || errno == EAGAIN) break;
+        logMsg(LOG_ERR, "ERROR in enterUring::io_uring_enter(2): %m");
+        return -1;
+    }
+
+    // Refused until CQ room or kernel resources free up, without waiting
+    // even if minwait was asked. The caller reaps and retries; with no
+    // CQE ready yet that would spin, so block until one arrives
+    while (*ring.cqhead == __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE)) {
+        int n = syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        ring.nenter += 1;
+        if (n >= 0) break;
+        else if (errno == EINTR) continue;
+        logMsg(LOG_ERR, "ERROR in enterUring::io_uring_enter(2): %m");
+        return -1;
+    }
+    return 0;
+}
+
+// Moves every available CQE to the stash, so a kernel refusing
+// submissions (EBUSY) gets CQ room back without running handlers
+static int stashCqes() {
+    unsigned head = *ring.cqhead;
+
+    while (head != __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE)) {
+        if (ring.nstash == ring.stashcap) {
+            size_t cap = ring.stashcap ? ring.stashcap * 2 : 64;
+            struct io_uring_cqe *stash = (struct io_uring_cqe *)realloc(ring.stash, cap * sizeof(*stash));
+            if (stash == NULL) {
+                logMsg(LOG_ERR, "ERROR in stashCqes::realloc(3): %m");
+                return -1;
+            }
+            ring.stash = stash;
+            ring.stashcap = cap;
+        }
+        ring.stash[ring.nstash++] = ring.cqes[head & *ring.cqmask];
+        __atomic_store_n(ring.cqhead, ++head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+// Ensures n free SQEs (linked pairs must go out in one submission)
+static int reserveSqes(unsigned n) {
+    while (*ring.sqtail + ring.unpublished - __atomic_load_n(ring.sqhead, __ATOMIC_ACQUIRE) + n > ring.sqentries) {
+        if (enterUring(0) == -1 || stashCqes() == -1) return -1;
+    }
+    return 0;
+}
+
+static struct io_uring_sqe *getSqe(void *ptr, int op) {
+    if (reserveSqes(1) == -1) return NULL;
+
+    unsigned idx = (*ring.sqtail + ring.unpublished) & *ring.sqmask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t)(uintptr_t)ptr | op;
+    ring.sqarray[idx] = idx;
+    ring.unpublished += 1;
+    return sqe;
+}
+
+static int registerUring(unsigned opcode, void *arg, unsigned nargs) {
+    ring.nsyscall += 1;
+    return syscall(__NR_io_uring_register, ring.fd, opcode, arg, nargs);
+}
+
+static int updateConnFile(int slot, int fd) {
+    struct io_uring_files_update up;
+    memset(&up, 0, sizeof(up));
+    up.offset = CONNFILE(slot);
+    up.fds = (uint64_t)(uintptr_t)&fd;
+    if (registerUring(IORING_REGISTER_FILES_UPDATE, &up, 1) == -1) {
+        logMsg(LOG_ERR, "ERROR in updateConnFile::io_uring_register(%i): %m", slot);
+        return -1;
+    }
+    return 0;
+}
+
+// Checks at runtime that the kernel supports io_uring and every opcode
+// this engine submits. Returns 0 if usable, -1 to fall back to epoll.
+int probeUring() {
+    static const int ops[] = { IORING_OP_ACCEPT, IORING_OP_READ_FIXED, IORING_OP_WRITE,
+        IORING_OP_SEND, IORING_OP_SENDMSG, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL };
+    unsigned features;
+    int status = 0;
+
+    if (setupUring(&ring, 4, &features) == -1) {
+        logMsg(LOG_INFO, "io_uring_setup(2) unavailable: %m");
+        return -1;
+    }
+
+    size_t psz = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, psz);
+    if (probe == NULL) status = -1;
+    else if (registerUring(IORING_REGISTER_PROBE, probe, 256) == -1) {
+        logMsg(LOG_INFO, "IORING_REGISTER_PROBE unavailable: %m");
+        status = -1;
+    }
+    else if (!(features & IORING_FEAT_FAST_POLL)) {
+        logMsg(LOG_INFO, "io_uring lacks IORING_FEAT_FAST_POLL");
+        status = -1;
+    }
+
+    for (size_t i = 0; status == 0 && i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            logMsg(LOG_INFO, "io_uring lacks opcode %i", ops[i]);
+            status = -1;
+        }
+    }
+
+    free(probe);
+    teardownUring(&ring);
+    return status;
+}
+
+static int submitAccept() {
+    if (acceptArmed || stopping || freeList == NULL) return 0;
+
+    UringConn *c = freeList;
+    struct io_uring_sqe *sqe = getSqe(c, UOP_ACCEPT);
+    if (sqe == NULL) return -1;
+
+    freeList = c->nextFree;
+    c->addrlen = sizeof(c->ct->claddr);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = LISTENFILE;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)&c->ct->claddr;
+    sqe->addr2 = (uint64_t)(uintptr_t)&c->addrlen;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    acceptSlot = c;
+    acceptArmed = 1;
+    return 0;
+}
+
+// One-shot POLLIN on the signalfd or timerfd, re-armed after each event
+static int submitPoll(uint64_t *tag) {
+    struct io_uring_sqe *sqe = getSqe(tag, UOP_POLL);
+    if (sqe == NULL) return -1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = tag == &signalTag ? SIGNALFILE : TIMERFILE;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->poll32_events = POLLIN;
+    if (tag == &signalTag) signalArmed = 1;
+    else timerArmed = 1;
+    return 0;
+}
+
+static int submitCancel(void *ptr, int op) {
+    struct io_uring_sqe *sqe = getSqe(NULL, 0);
+    if (sqe == NULL) return -1;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)(uintptr_t)ptr | op;
+    return 0;
+}
+
+static int submitRecv(UringConn *c) {
+    struct io_uring_sqe *sqe = getSqe(c, UOP_RECV);
+    if (sqe == NULL) return -1;
+
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = CONNFILE(c->slot);
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)c->ct->rx.data;
+    sqe->len = RECVBUFSZ;
+    sqe->buf_index = c->slot;
+    c->inflight += 1;
+    c->state = UCONN_RECV;
+    return 0;
+}
+
+// Reserves the append's backend range and queues its write; the node
+// joins the publish FIFO in reservation order
+static int submitAppend(AppendNode *a) {
+    struct io_uring_sqe *sqe = getSqe(a, UOP_APPEND);
+    if (sqe == NULL) return -1;
+
+    a->off = reserveAppend(a->n);
+    a->t0 = metricsClock();
+    a->done = a->ok = 0;
+    a->queued = 1;
+    a->next = NULL;
+    if (fifoTail) fifoTail->next = a;
+    else fifoHead = a;
+    fifoTail = a;
+
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = BACKENDFILE;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)a->data;
+    sqe->len = a->n;
+    sqe->off = a->off;
+    if (a->conn) {
+        a->conn->inflight += 1;
+        a->conn->state = UCONN_APPEND;
+    }
+    return 0;
+}
+
+static int submitTimestamp() {
+    AppendNode *a = (AppendNode *)malloc(sizeof(AppendNode));
+    if (a == NULL) {
+        logMsg(LOG_ERR, "ERROR in submitTimestamp::malloc(3): %m");
+        return -1;
+    }
+
+    ssize_t n = formatTimestamp(a->tsbuf, sizeof(a->tsbuf));
+    a->data = a->tsbuf;
+    a->n = n;
+    a->conn = NULL;
+    if (n == -1 || submitAppend(a) == -1) {
+        free(a);
+        return -1;
+    }
+    return 0;
+}
+
+// Sends next part of the History snapshot with one sendmsg(2)
+static int submitSnapSend(UringConn *c) {
+    struct io_uring_sqe *sqe = getSqe(c, UOP_SENDMSG);
+    if (sqe == NULL) return -1;
+
+    memset(&c->msg, 0, sizeof(c->msg));
+    c->msg.msg_iov = c->iov;
+    c->msg.msg_iovlen = snapshotIov(&c->snap, c->snapoff, c->iov, SENDIOV);
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = CONNFILE(c->slot);
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)&c->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    c->inflight += 1;
+    c->state = UCONN_SEND;
+    return 0;
+}
+
+// Sends iobuf bytes [ioff, ilen) left over by a short read or send
+static int submitSendBuf(UringConn *c) {
+    struct io_uring_sqe *sqe = getSqe(c, UOP_SEND);
+    if (sqe == NULL) return -1;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = CONNFILE(c->slot);
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)&c->iobuf[c->ioff];
+    sqe->len = c->ilen - c->ioff;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    c->inflight += 1;
+    return 0;
+}
+
+static int advanceConn(UringConn *c);
+
+// Streams backend range [soff, send) as linked READ_FIXED -> SEND pairs
+// through the slot's registered iobuf, one URINGIOBUFSZ block at a time
+static int submitRange(UringConn *c) {
+    if (c->soff >= c->send) return advanceConn(c);
+    else if (reserveSqes(2) == -1) return -1;
+
+    size_t want = URINGIOBUFSZ;
+    if ((off_t)want > c->send - c->soff) want = c->send - c->soff;
+
+    struct io_uring_sqe *rd = getSqe(c, UOP_READ);
+    rd->opcode = IORING_OP_READ_FIXED;
+    rd->fd = BACKENDFILE;
+    rd->flags = IOSQE_FIXED_FILE|IOSQE_IO_LINK;
+    rd->addr = (uint64_t)(uintptr_t)c->iobuf;
+    rd->len = want;
+    rd->off = c->soff;
+    rd->buf_index = URINGSLOTS + c->slot;
+
+    // Cancelled by the kernel if the read comes up short
+    struct io_uring_sqe *sd = getSqe(c, UOP_SEND);
+    sd->opcode = IORING_OP_SEND;
+    sd->fd = CONNFILE(c->slot);
+    sd->flags = IOSQE_FIXED_FILE;
+    sd->addr = (uint64_t)(uintptr_t)c->iobuf;
+    sd->len = want;
+    sd->msg_flags = MSG_NOSIGNAL;
+
+    c->ioff = c->ilen = 0;
+    c->ioerr = 0;
+    c->inflight += 2;
+    c->state = UCONN_SEND;
+    return 0;
+}
+
+// Responds to a published append (or DELTA line): History snapshot when
+// the mirror is warm, otherwise the backend range, from responseStart()
+static int startResponse(UringConn *c) {
+    off_t start = responseStart(c->ct);
+
+    if (snapshotBackend(&c->snap) == 0) {
+        c->usesnap = 1;
+        c->snapoff = (size_t)start < c->snap.len ? (size_t)start : c->snap.len;
+        c->ct->cursor = c->snap.len;
+        return submitSnapSend(c);
+    }
+
+    if (backendKind() == BACKEND_CHARDEV) ring.nsyscall += 1;
+    if ((c->send = observeBackendEnd()) == -1) return -1;
+    c->soff = start < c->send ? start : c->send;
+    c->ct->cursor = c->send;
+    return submitRange(c);
+}
+
+static int processLine(UringConn *c) {
+    ConnThread *ct = c->ct;
+    Command cmd;
+    ssize_t n;
+
+    ring.nrequest += 1;
+    switch (parseCommand(c->line.data, c->line.index, &cmd)) {
+    // If ioctl cmd line, send back content only from new lseek offset
+    case CMD_SEEKTO:
+        reset(&c->line);
+        if (backendKind() == BACKEND_CHARDEV) ring.nsyscall += 2; // ioctl(2) + lseek(2)
+        if (sendIoctl(ct, &cmd.arg.seekto) == -1) return -1;
+        c->soff = ct->rpos;
+        if (backendKind() == BACKEND_CHARDEV) ring.nsyscall += 1;
+        if ((c->send = observeBackendEnd()) == -1) return -1;
+        ct->cursor = c->send;
+        return submitRange(c);
+
+    // If stats cmd line, send back the metrics report from iobuf
+    case CMD_STATS:
+        reset(&c->line);
+        if ((n = formatStats(c->iobuf, URINGIOBUFSZ)) == -1) return -1;
+        c->soff = c->send = 0;
+        c->ioff = 0;
+        c->ilen = n;
+        return submitSendBuf(c);
+
+    // If delta cmd line, switch to delta mode and send back content up to now
+    case CMD_DELTA:
+        reset(&c->line);
+        enableDelta(ct);
+        return startResponse(c);
+
+    // If standard line, write it to backend and respond once published
+    case CMD_NONE:
+    default:
+        c->append.data = c->line.data;
+        c->append.n = c->line.index;
+        c->append.conn = c;
+        return submitAppend(&c->append);
+    }
+}
+
+// Processes the next buffered line, or reads more input when none is
+// complete. Returns -1 when the connection is finished (EOF or ERROR).
+static int advanceConn(UringConn *c) {
+    ConnThread *ct = c->ct;
+    int rc;
+
+    if (stopping) return -1;
+    else if ((rc = takeLine(&ct->rx, &c->line)) == -1) return -1;
+    else if (rc == 1) {
+        gatherBatch(ct, &c->line);
+        return processLine(c);
+    }
+    else if (c->eof) {
+        // Flush final unterminated line as readLine() does
+        if (c->line.index == 0) return -1;
+        return processLine(c);
+    }
+    return submitRecv(c);
+}
+
+// Returns a CLOSING slot to the free list once the kernel holds no
+// more references to it (no ops in flight, append published)
+static void recycleConn(UringConn *c) {
+    ConnThread *ct = c->ct;
+    if (c->inflight > 0 || c->append.queued) return;
+
+    updateConnFile(c->slot, -1);
+    close(ct->cfd);
+    countMetric(M_CLOSED, 1);
+    ring.nsyscall += 1;
+    logMsg(LOG_DEBUG, "[TID: %i] Closed connection", ct->tid);
+
+    if (c->usesnap) releaseSnapshot(&c->snap);
+    c->usesnap = 0;
+    reset(&c->line);
+    resetConnThread(ct);
+    ct->cfd = -1;
+    c->state = UCONN_FREE;
+    c->nextFree = freeList;
+    freeList = c;
+    nconns -= 1;
+    submitAccept();
+}
+
+static int closeConn(UringConn *c) {
+    if (c->state != UCONN_CLOSING) {
+        c->state = UCONN_CLOSING;
+        // Completes any pending socket ops so the slot can drain
+        if (c->inflight > 0) {
+            shutdown(c->ct->cfd, SHUT_RDWR);
+            ring.nsyscall += 1;
+        }
+    }
+    recycleConn(c);
+    return 0;
+}
+
+static void onAccept(UringConn *c, int res) {
+    acceptArmed = 0;
+    if (res < 0) {
+        if (res != -ECANCELED && res != -ECONNABORTED && res != -EINTR) {
+            errno = -res;
+            logMsg(LOG_ERR, "ERROR in onAccept::accept(2): %m");
+        }
+        c->nextFree = freeList;
+        freeList = c;
+        submitAccept();
+        return;
+    }
+
+    c->ct->cfd = res;
+    if (updateConnFile(c->slot, res) == -1) {
+        close(res);
+        c->ct->cfd = -1;
+        c->nextFree = freeList;
+        freeList = c;
+        submitAccept();
+        return;
+    }
+
+    logMsg(LOG_DEBUG, "[TID: %i] Accepted connection (io_uring)", c->ct->tid);
+    countMetric(M_ACCEPTED, 1);
+    nconns += 1;
+    c->eof = 0;
+    c->inflight = 0;
+    c->append.queued = 0;
+    if (stopping || submitRecv(c) == -1) closeConn(c);
+    submitAccept();
+}
+
+static void onRecv(UringConn *c, int res) {
+    ConnThread *ct = c->ct;
+
+    if (res < 0) {
+        errno = -res;
+        logMsg(LOG_ERR, "ERROR in onRecv::read(%i): %m", ct->cfd);
+        closeConn(c);
+        return;
+    }
+
+    ct->rx.head = 0;
+    ct->rx.tail = res;
+    if (res == 0) c->eof = 1;
+    if (advanceConn(c) == -1) closeConn(c);
+}
+
+// Publishes finished appends in reservation order and starts the
+// response of each connection whose append got published
+static void publishReady() {
+    while (fifoHead && fifoHead->done) {
+        AppendNode *a = fifoHead;
+        if ((fifoHead = a->next) == NULL) fifoTail = NULL;
+        a->queued = 0;
+
+        publishAppend(a->data, a->off, a->n, a->ok);
+        UringConn *c = a->conn;
+        if (c) recordLatency(H_WRITE, metricsClock() - a->t0);
+        if (c == NULL) {
+            free(a);
+            continue;
+        }
+        else if (c->state == UCONN_CLOSING) {
+            recycleConn(c);
+            continue;
+        }
+
+        logMsg(LOG_DEBUG, "[TID: %i] Wrote %zu bytes to %s", c->ct->tid, a->n, c->ct->backend);
+        reset(&c->line);
+        if (!a->ok || startResponse(c) == -1) closeConn(c);
+    }
+}
+
+static void onAppend(AppendNode *a, int res) {
+    if (res >= 0 && (size_t)res < a->n) {
+        // Rare short write: finish synchronously at the reserved offset
+        ssize_t nw = res;
+        if (appendBackend(a->data + nw, a->n - nw, a->off + nw) == -1) res = -errno;
+    }
+
+    if (res < 0) {
+        errno = -res;
+        logMsg(LOG_ERR, "ERROR in onAppend::write(2): %m");
+    }
+    a->ok = res >= 0;
+    a->done = 1;
+    if (a->conn) a->conn->inflight -= 1;
+    publishReady();
+}
+
+static void onSendMsg(UringConn *c, int res) {
+    if (res > 0) countMetric(M_SENT, res);
+    if (c->state == UCONN_CLOSING) recycleConn(c);
+    else if (res < 0) {
+        errno = -res;
+        logMsg(LOG_ERR, "ERROR in onSendMsg::sendmsg(%i): %m", c->ct->cfd);
+        closeConn(c);
+    }
+    else if ((c->snapoff += res) < c->snap.len) {
+        if (submitSnapSend(c) == -1) closeConn(c);
+    }
+    else {
+        releaseSnapshot(&c->snap);
+        c->usesnap = 0;
+        if (advanceConn(c) == -1) closeConn(c);
+    }
+}
+
+static void onRead(UringConn *c, int res) {
+    if (c->state == UCONN_CLOSING) recycleConn(c);
+    else if (res < 0) {
+        errno = -res;
+        logMsg(LOG_ERR, "ERROR in onRead::read(%i): %m", c->ct->fd);
+        c->soff = c->send;
+        c->ioerr = 1; // Linked send gets cancelled, then connection closes
+    }
+    else if (res == 0) c->soff = c->send; // Backend shrank, nothing left
+    else {
+        c->ilen = res;
+        c->soff += res;
+    }
+}
+
+static void onSend(UringConn *c, int res) {
+    int status = 0;
+
+    if (res > 0) countMetric(M_SENT, res);
+    if (c->state == UCONN_CLOSING) {
+        recycleConn(c);
+        return;
+    }
+    else if (res == -ECANCELED) {
+        // Short read broke the link: send what was read, if anything
+        if (c->ioerr) status = -1;
+        else if (c->ilen > 0) status = submitSendBuf(c);
+        else status = submitRange(c);
+    }
+    else if (res < 0) {
+        errno = -res;
+        logMsg(LOG_ERR, "ERROR in onSend::send(%i): %m", c->ct->cfd);
+        status = -1;
+    }
+    else if ((c->ioff += res) < c->ilen) status = submitSendBuf(c);
+    else status = submitRange(c);
+
+    if (status == -1) closeConn(c);
+}
+
+static int onSignal(int sigfd) {
+    signalArmed = 0;
+    ring.nsyscall += 1;
+    if (readExitSignal(sigfd)) stopping = 1;
+    return stopping ? 0 : submitPoll(&signalTag);
+}
+
+static int onTimer(int tfd) {
+    int status = 0;
+
+    timerArmed = 0;
+    ring.nsyscall += 1;
+    if (readTimer(tfd) > 0 && !stopping && submitTimestamp() == -1) status = -1;
+    if (!stopping && submitPoll(&timerTag) == -1) status = -1;
+    return status;
+}
+
+// Handles every available completion, stashed ones first. Handlers
+// may stash more (their submissions wait for room), so both are
+// re-read on every pass.
+static int reapUring(int sigfd, int tfd) {
+    size_t nstashed = 0;
+    int status = 0;
+
+    while (1) {
+        uint64_t ud;
+        int res;
+        unsigned head = *ring.cqhead;
+        if (nstashed < ring.nstash) {
+            ud = ring.stash[nstashed].user_data;
+            res = ring.stash[nstashed++].res;
+        }
+        else if (head != __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqmask];
+            ud = cqe->user_data;
+            res = cqe->res;
+            __atomic_store_n(ring.cqhead, head + 1, __ATOMIC_RELEASE);
+        }
+        else break;
+
+        void *ptr = (void *)(uintptr_t)(ud & ~(uint64_t)UOPMASK);
+        UringConn *c = (UringConn *)ptr;
+        int op = ud & UOPMASK;
+
+        if (op != UOP_ACCEPT && op != UOP_POLL && op != UOP_APPEND && c) c->inflight -= 1;
+
+        switch (op) {
+        case UOP_ACCEPT: onAccept(c, res); break;
+        case UOP_POLL:
+            if (ptr == &signalTag && onSignal(sigfd) == -1) status = -1;
+            else if (ptr == &timerTag && onTimer(tfd) == -1) status = -1;
+            break;
+        case UOP_RECV:
+            if (c->state == UCONN_CLOSING) recycleConn(c);
+            else onRecv(c, res);
+            break;
+        case UOP_APPEND: onAppend((AppendNode *)ptr, res); break;
+        case UOP_SENDMSG: onSendMsg(c, res); break;
+        case UOP_READ: onRead(c, res); break;
+        case UOP_SEND: onSend(c, res); break;
+        default: break; // Cancel requests
+        }
+    }
+    ring.nstash = 0;
+    return status;
+}
+
+static int initSlots(const char *backend, char **iobufs, struct iovec *bufs) {
+    if ((*iobufs = (char *)malloc((size_t)URINGSLOTS * URINGIOBUFSZ)) == NULL) {
+        logMsg(LOG_ERR, "ERROR in initSlots::malloc(3): %m");
+        return -1;
+    }
+
+    for (int i = URINGSLOTS - 1; i >= 0; i--) {
+        UringConn *c = (UringConn *)calloc(1, sizeof(UringConn));
+        if (c == NULL || (c->ct = newConnThread(backend)) == NULL) {
+            logMsg(LOG_ERR, "ERROR in initSlots::calloc(3): %m");
+            free(c);
+            return -1;
+        }
+
+        c->slot = i;
+        c->state = UCONN_FREE;
+        c->line = newLineBuffer();
+        c->iobuf = &(*iobufs)[(size_t)i * URINGIOBUFSZ];
+        bufs[i].iov_base = c->ct->rx.data;
+        bufs[i].iov_len = RECVBUFSZ;
+        bufs[URINGSLOTS + i].iov_base = c->iobuf;
+        bufs[URINGSLOTS + i].iov_len = URINGIOBUFSZ;
+
+        slots[i] = c;
+        c->nextFree = freeList;
+        freeList = c;
+    }
+    return 0;
+}
+
+static void destroySlots() {
+    for (int i = 0; i < URINGSLOTS; i++) {
+        UringConn *c = slots[i];
+        if (c == NULL) continue;
+        if (c->usesnap) releaseSnapshot(&c->snap);
+        destroy(&c->line);
+        freeConnThread(c->ct);
+        free(c);
+        slots[i] = NULL;
+    }
+    freeList = NULL;
+}
+
+// Runs the engine until sigfd reports SIGINT/SIGTERM, appending a
+// timestamp whenever timerfd tfd expires (-1 for none)
+int uringEventLoop(int sfd, const char *backend, int sigfd, int tfd) {
+    struct iovec bufs[2 * URINGSLOTS];
+    int files[NFILES];
+    char *iobufs = NULL;
+    int retstatus = 0;
+
+    if (setupUring(&ring, RINGENTRIES, NULL) == -1) {
+        logMsg(LOG_ERR, "ERROR in uringEventLoop::io_uring_setup(2): %m");
+        return -1;
+    }
+
+    for (int i = 0; i < NFILES; i++) files[i] = -1;
+    files[BACKENDFILE] = backendFileno();
+    files[LISTENFILE] = sfd;
+    files[SIGNALFILE] = sigfd;
+    files[TIMERFILE] = tfd;
+
+    if (initSlots(backend, &iobufs, bufs) == -1) retstatus = -1;
+    else if (registerUring(IORING_REGISTER_FILES, files, NFILES) == -1) {
+        logMsg(LOG_ERR, "ERROR in uringEventLoop::io_uring_register(FILES): %m");
+        retstatus = -1;
+    }
+    else if (registerUring(IORING_REGISTER_BUFFERS, bufs, 2 * URINGSLOTS) == -1) {
+        logMsg(LOG_ERR, "ERROR in uringEventLoop::io_uring_register(BUFFERS): %m");
+        retstatus = -1;
+    }
+    else if (submitPoll(&signalTag) == -1 || submitAccept() == -1) retstatus = -1;
+    else if (tfd != -1 && submitPoll(&timerTag) == -1) retstatus = -1;
+
+    while (retstatus == 0 && !stopping) {
+        if (enterUring(1) == -1 || reapUring(sigfd, tfd) == -1) retstatus = -1;
+    }
+
+    // Drain: close every connection and cancel the accept, signal and
+    // timer polls, then wait until the kernel holds no references to slots
+    stopping = 1;
+    for (int i = 0; i < URINGSLOTS; i++) {
+        UringConn *c = slots[i];
+        if (c && c->state != UCONN_FREE) closeConn(c);
+    }
+    if (acceptArmed) submitCancel(acceptSlot, UOP_ACCEPT);
+    if (signalArmed) submitCancel(&signalTag, UOP_POLL);
+    if (timerArmed) submitCancel(&timerTag, UOP_POLL);
+    while (acceptArmed || signalArmed || timerArmed || nconns > 0 || fifoHead) {
+        if (enterUring(1) == -1) break;
+        reapUring(sigfd, tfd);
+    }
+
+    logMsg(LOG_DEBUG, "io_uring engine: %lu requests, %lu io_uring_enter(2) + %lu other syscalls (%.2f per request)",
+        ring.nrequest, ring.nenter, ring.nsyscall,
+        ring.nrequest ? (double)(ring.nenter + ring.nsyscall) / ring.nrequest : 0.0);
+
+    // Drop fixed file references now, ring teardown completes asynchronously
+    // and would otherwise keep the listen port bound past exit
+    registerUring(IORING_UNREGISTER_FILES, NULL, 0);
+    teardownUring(&ring);
+    destroySlots();
+    free(iobufs);
+    if (retstatus == 0) logMsg(LOG_DEBUG, "Caught signal, exiting");
+    return retstatus;
+}
@@ -0,0 +1,95 @@
+#ifndef URINGLOOP_H
+#define URINGLOOP_H
+
+#include "connthread.h"
+
+#include <linux/io_uring.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define URINGSLOTS 128   // Max concurrent connections (fixed file/buffer slots)
+#define URINGIOBUFSZ 16384
+
+/*
+    Minimal io_uring wrapper over the raw syscalls (no liburing):
+    mmap'd submission/completion rings plus counters used to report
+    syscalls per request at exit. SQEs queued while handling a batch
+    of completions go out with the next single io_uring_enter(2).
+    unpublished counts SQEs filled past the shared tail, pending those
+    published that the kernel has not taken yet. CQEs moved off the
+    ring while a submission waited for room (stash) are handled by
+    the next reap, never from inside a submission.
+*/
+typedef struct {
+    int fd;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqring, *cqring;
+    size_t sqringsz, cqringsz, sqessz;
+    unsigned sqentries, unpublished, pending;
+    struct io_uring_cqe *stash;
+    size_t nstash, stashcap;
+
+    unsigned long nenter, nsyscall, nrequest;
+} Uring;
+
+/*
+    Backend append in flight. Appends complete in any order but are
+    published (History, backend end offset) in reservation order, so
+    nodes queue in a FIFO until every earlier one is done. conn is
+    NULL for timestamp lines, which own their data in tsbuf.
+*/
+typedef struct UringConn UringConn;
+typedef struct AppendNode AppendNode;
+
+struct AppendNode {
+    off_t off;
+    size_t n;
+    const char *data;
+    int done, ok, queued;
+    uint64_t t0;         // Submit time, for the H_WRITE histogram
+    UringConn *conn;
+    char tsbuf[64];
+    AppendNode *next;
+};
+
+/*
+    Per-connection state for the io_uring engine. Slots are allocated
+    once at startup: slot i owns fixed file 4+i and registered buffers
+    i (ct->rx.data, socket reads) and URINGSLOTS+i (iobuf, backend
+    reads). A connection alternates between RECV, APPEND (waiting for
+    its write to be published) and SEND (History snapshot via sendmsg,
+    or backend range [soff, send) via linked READ_FIXED -> SEND pairs).
+    inflight counts submitted ops; a CLOSING slot is recycled only
+    once it drops to zero and its append has been published.
+*/
+typedef enum { UCONN_FREE, UCONN_RECV, UCONN_APPEND, UCONN_SEND, UCONN_CLOSING } UringConnState;
+
+struct UringConn {
+    ConnThread *ct;
+    UringConnState state;
+    LineBuffer line;
+    int slot, eof, inflight;
+    socklen_t addrlen;
+    AppendNode append;
+
+    HistSnapshot snap;   // History snapshot being sent, if usesnap
+    size_t snapoff;
+    int usesnap;
+    struct iovec iov[16];
+    struct msghdr msg;
+
+    char *iobuf;         // Backend bytes [ioff, ilen) read but not yet sent
+    size_t ioff, ilen;
+    int ioerr;           // Backend read failed, close after linked send
+    off_t soff, send;    // Backend range still to be read
+
+    UringConn *nextFree;
+};
+
+int probeUring();
+int uringEventLoop(int sfd, const char *backend, int sigfd, int tfd);
+
+#endif /* URINGLOOP_H */
@@ -0,0 +1,96 @@
+#include "zblock.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+
+// Positional write of all n bytes. Returns 0, or -1 on ERROR.
+static int writeAll(int fd, const char *data, size_t n, off_t off) {
+    size_t numWrite = 0;
+
+    while (numWrite < n) {
+        ssize_t nw = pwrite(fd, data + numWrite, n - numWrite, off + numWrite);
+        if (nw == -1 && errno == EINTR) continue;
+        else if (nw <= 0) return -1;
+        numWrite += nw;
+    }
+    return 0;
+}
+
+// Deflates data block by block at level into fd, from offset 0, and
+// fills zi with the block index. Returns 0, or -1 on ERROR.
+int packBlocks(int fd, const char *data, size_t n, int level, ZIndex *zi) {
+    uLong bound = compressBound(ZBLOCK);
+    size_t nblocks = (n + ZBLOCK - 1) / ZBLOCK;
+    char *out = (char *)malloc(bound);
+    off_t *index = (off_t *)malloc((nblocks + 1) * sizeof(off_t));
+
+    if (out == NULL || index == NULL) {
+        logMsg(LOG_ERR, "ERROR in packBlocks::malloc(3): %m");
+        free(out);
+        free(index);
+        return -1;
+    }
+
+    index[0] = 0;
+    for (size_t i = 0; i < nblocks; i++) {
+        size_t raw = n - i * ZBLOCK < ZBLOCK ? n - i * ZBLOCK : ZBLOCK;
+        uLongf packed = bound;
+        int zrc = compress2((Bytef *)out, &packed, (const Bytef *)data + i * ZBLOCK, raw, level);
+        if (zrc != Z_OK) {
+            logMsg(LOG_ERR, "ERROR in packBlocks::compress2(3): %s", zError(zrc));
+            free(out);
+            free(index);
+            return -1;
+        }
+        if (writeAll(fd, out, packed, index[i]) == -1) {
+            logMsg(LOG_ERR, "ERROR in packBlocks::pwrite(%i): %m", fd);
+            free(out);
+            free(index);
+            return -1;
+        }
+        index[i + 1] = index[i] + packed;
+    }
+    free(out);
+
+    zi->index = index;
+    zi->nblocks = nblocks;
+    zi->rawsize = n;
+    zi->packed = index[nblocks];
+    return 0;
+}
+
+// Inflates block blk of fd into out (ZBLOCK bytes). Returns its raw
+// length, or -1 on ERROR.
+ssize_t unpackBlock(int fd, const ZIndex *zi, size_t blk, char *out) {
+    char stackbuf[16384];
+    size_t packed = zi->index[blk + 1] - zi->index[blk];
+    char *in = packed <= sizeof(stackbuf) ? stackbuf : (char *)malloc(packed);
+    ssize_t numRead;
+
+    if (in == NULL) {
+        logMsg(LOG_ERR, "ERROR in unpackBlock::malloc(3): %m");
+        return -1;
+    }
+    while ((numRead = pread(fd, in, packed, zi->index[blk])) == -1 && errno == EINTR) ;
+
+    uLongf raw = ZBLOCK;
+    int zrc = numRead == (ssize_t)packed ? uncompress((Bytef *)out, &raw, (const Bytef *)in, packed) : Z_DATA_ERROR;
+    if (in != stackbuf) free(in);
+    if (zrc != Z_OK) {
+        logMsg(LOG_ERR, "ERROR in unpackBlock::uncompress(3): %s", numRead == -1 ? strerror(errno) : zError(zrc));
+        errno = EIO;
+        return -1;
+    }
+    return raw;
+}
+
+void freeZIndex(ZIndex *zi) {
+    free(zi->index);
+    zi->index = NULL;
+    zi->nblocks = 0;
+}
@@ -0,0 +1,28 @@
+#ifndef ZBLOCK_H
+#define ZBLOCK_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define ZBLOCK ((size_t)64 << 10) // Raw bytes per compressed block
+
+/*
+    Block-compressed file format for sealed segments: the raw content
+    is cut into ZBLOCK byte blocks, each deflated on its own (zlib
+    format), and the blocks are written back to back. The block index
+    (kept by the caller, not in the file) holds nblocks + 1 file
+    offsets, block i spanning [index[i], index[i + 1]), so any raw
+    offset is served by inflating the one block holding it.
+*/
+typedef struct {
+    off_t *index;
+    size_t nblocks;
+    size_t rawsize;
+    off_t packed;        // File size, index[nblocks]
+} ZIndex;
+
+int packBlocks(int fd, const char *data, size_t n, int level, ZIndex *zi);
+ssize_t unpackBlock(int fd, const ZIndex *zi, size_t blk, char *out);
+void freeZIndex(ZIndex *zi);
+
+#endif /* ZBLOCK_H */